@@ -17,40 +17,62 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include "data_file.h"
+#if !IS_WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
-static uint32_t HEX_ReadFile(const char *file, uint8_t *out_buf, uint32_t out_buf_size);
-static int HEX_WriteFile(const char *file, uint8_t *in_buf, uint32_t in_buf_size);
-static int HEX_CheckType(const char *);
-static uint32_t BIN_ReadFile(const char *file, uint8_t *out_buf, uint32_t out_buf_size);
-static int BIN_WriteFile(const char *file, uint8_t *in_buf, uint32_t in_buf_size);
-static int BIN_CheckType(const char *);
+#include "data_file.h"
 
-// TODO: implement BIT file reading/ writing?
+static int HEX_ReadImage(const char *file, struct data_image_t *img);
+static int HEX_WriteImage(const char *file, struct data_image_t *img);
+static int HEX_CheckType(const uint8_t *buf, uint32_t size);
+static int HEX_OpenStream(struct data_stream_t *s);
+static int HEX_ReadStream(struct data_stream_t *s, uint8_t *buf, uint32_t size);
+static int BIN_ReadImage(const char *file, struct data_image_t *img);
+static int BIN_WriteImage(const char *file, struct data_image_t *img);
+static int BIN_CheckType(const uint8_t *buf, uint32_t size);
+static int BIN_OpenStream(struct data_stream_t *s);
+static int BIN_ReadStream(struct data_stream_t *s, uint8_t *buf, uint32_t size);
+static int BIT_ReadImage(const char *file, struct data_image_t *img);
+static int BIT_WriteImage(const char *file, struct data_image_t *img);
+static int BIT_CheckType(const uint8_t *buf, uint32_t size);
+static int BIT_OpenStream(struct data_stream_t *s);
+static int BIT_ReadStream(struct data_stream_t *s, uint8_t *buf, uint32_t size);
 
 #define FILE_OPS_CNT (sizeof(file_ops)/sizeof(struct file_ops_t))
 const struct file_ops_t file_ops[] = {
 	{
 		.name = "HEX",
-		.ReadFile = HEX_ReadFile,
-		.WriteFile = HEX_WriteFile,
+		.ReadImage = HEX_ReadImage,
+		.WriteImage = HEX_WriteImage,
 		.CheckType = HEX_CheckType,
+		.OpenStream = HEX_OpenStream,
+		.ReadStream = HEX_ReadStream,
 	},
-/*	{
+	{
 		.name = "BIT",
-		.ReadFile = BIT_ReadFile,
-		.WriteFile = BIT_WriteFile,
+		.ReadImage = BIT_ReadImage,
+		.WriteImage = BIT_WriteImage,
 		.CheckType = BIT_CheckType,
-	},*/
+		.OpenStream = BIT_OpenStream,
+		.ReadStream = BIT_ReadStream,
+	},
 	{
 		.name = "BIN",
-		.ReadFile = BIN_ReadFile,
-		.WriteFile = BIN_WriteFile,
+		.ReadImage = BIN_ReadImage,
+		.WriteImage = BIN_WriteImage,
 		.CheckType = BIN_CheckType,
+		.OpenStream = BIN_OpenStream,
+		.ReadStream = BIN_ReadStream,
 	}
 };
 
@@ -67,6 +89,72 @@ struct file_ops_t *GetFileOps(char *name)
 	return NULL;
 }
 
+// value of hex digit, HEX_BAD for anything else
+#define HEX_BAD 0x10
+static uint8_t hex_nibble[256];
+
+static void HEX_InitTable(void)
+{
+	int i;
+
+	if (hex_nibble[0] == HEX_BAD)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		hex_nibble[i] = HEX_BAD;
+	}
+	for (i = 0; i < 10; i++) {
+		hex_nibble['0' + i] = i;
+	}
+	for (i = 0; i < 6; i++) {
+		hex_nibble['A' + i] = 10 + i;
+		hex_nibble['a' + i] = 10 + i;
+	}
+}
+
+/*
+ * detects type of file from its content
+ * returns NULL if file can't be read or its type is not supported
+ */
+struct file_ops_t *Data_DetectType(const char *file)
+{
+	struct file_ops_t *fo = NULL;
+	const uint8_t *map;
+	uint32_t map_size;
+	uint32_t size;
+	int i;
+
+	map = Data_MapFile(file, &map_size);
+	if (map == NULL) {
+		fprintf(stderr, "Unable to open file '%s'\n", file);
+		return NULL;
+	}
+
+	HEX_InitTable();
+
+	// only start of the file is looked at
+	size = (map_size > DATA_SNIFF_SIZE) ? DATA_SNIFF_SIZE : map_size;
+
+	// motorola S-record: "S0".."S9" followed by hex digits
+	if ((size >= 4) && (map[0] == 'S') && (map[1] >= '0') && (map[1] <= '9') &&
+	    (hex_nibble[map[2]] != HEX_BAD) && (hex_nibble[map[3]] != HEX_BAD)) {
+		fprintf(stderr, "File '%s' is a S-record file, which is not supported\n", file);
+		Data_UnmapFile(map, map_size);
+		return NULL;
+	}
+
+	// BIN takes anything, it is last
+	for (i = 0; i < FILE_OPS_CNT; i++) {
+		if (file_ops[i].CheckType(map, size)) {
+			fo = (struct file_ops_t *)&file_ops[i];
+			break;
+		}
+	}
+
+	Data_UnmapFile(map, map_size);
+	return fo;
+}
+
 /*
  * returns checksum of input buffer
  */
@@ -82,289 +170,1474 @@ uint8_t Data_Checksum(uint8_t *buf, uint16_t size)
 }
 
 /*
- * reads hex file
- * file - name of hexfile
- * buf - buffer where the data should be written to
- * size - size of buffer
+ * returns 1 if buffer contains only erased (0xff) bytes
  */
-#define MAX_LINE_SIZE 256
-static uint32_t HEX_ReadFile(const char *file, uint8_t *out_buf, uint32_t out_buf_size)
+int Data_IsBlank(uint8_t *buf, uint32_t size)
 {
-	char raw_line[MAX_LINE_SIZE];
-	int line = 0;
-	uint32_t base_addr;
-	FILE *fp;
-	uint32_t addr_max=0;
-	uint8_t *tmp;
-	uint16_t tmp_len;
-	uint8_t chksum;
-	uint16_t i;
-	unsigned int b;
+	uint32_t i;
+	uint8_t acc = 0xff;
+
+	for (i = 0; i < size; i++) {
+		acc &= buf[i];
+	}
+	return acc == 0xff;
+}
 
-	fp = fopen(file, "r");
+/*
+ * prepares compare result
+ * diff - array for reported ranges
+ * max - size of diff array, more ranges are only counted
+ */
+void Data_CompareInit(struct data_cmp_t *cmp, struct data_diff_t *diff, int max)
+{
+	memset(cmp, 0, sizeof(struct data_cmp_t));
+	cmp->diff = diff;
+	cmp->max = max;
+}
 
-	if (fp == NULL) {
-		return 0;
+static void Data_DiffAdd(struct data_cmp_t *cmp, uint32_t addr)
+{
+	struct data_diff_t *open = &cmp->open;
+
+	cmp->bytes ++;
+
+	// byte out of order never extends range backwards, it starts new one
+	if (cmp->ranges && (addr >= open->addr) && (addr <= open->addr + open->len + DATA_DIFF_GAP)) {
+		if (addr - open->addr + 1 > open->len)
+			open->len = addr - open->addr + 1;
+		open->count ++;
+		return;
 	}
 
-	tmp = malloc(sizeof(raw_line)+1);
-	if (tmp == NULL) {
-		fprintf(stderr, "Memory allocation problem\n");
-		return 0;
+	// new range, previous one is complete
+	if (cmp->ranges && (cmp->count < cmp->max)) {
+		cmp->diff[cmp->count++] = *open;
 	}
 
+	cmp->ranges ++;
+	open->addr = addr;
+	open->len = 1;
+	open->count = 1;
+}
 
-	while(fgets(raw_line, sizeof(raw_line), fp) != 0) {
-		// read line header
-		uint8_t byte_count;
-		uint32_t addr;
-		uint8_t rec_type;
-		const char *p;
+/*
+ * compares buffers 8 bytes at a time, differing bytes are collected
+ * into ranges, consecutive calls continue the same ranges. Calls have
+ * to go in ascending address order, otherwise ranges get split.
+ * ref - expected data
+ * mem - data read back
+ * len - length of both
+ * offset - address of first byte
+ * returns number of differing bytes
+ */
+uint32_t Data_Compare(struct data_cmp_t *cmp, const uint8_t *ref, const uint8_t *mem, uint32_t len, uint32_t offset)
+{
+	uint32_t before = cmp->bytes;
+	uint64_t a, b;
+	uint32_t end;
+	uint32_t i = 0;
 
-		if (raw_line[0] != ':') {
-			printf("File '%s' is note a hex file !\n", file);
-			return 0;
+	while (i < len) {
+		// skip matching words
+		while (i + 8 <= len) {
+			memcpy(&a, ref + i, 8);
+			memcpy(&b, mem + i, 8);
+			if (a != b)
+				break;
+			i += 8;
 		}
 
-		line ++;
-		p = raw_line + 1;
-
-		tmp_len = 0;
-		// read byte count (1byte), address (2byte), record type (1byte)
-		for (i = 0; i < 4; i ++) {
-			sscanf(p, "%2x", &b);
-			p += 2;
-			tmp[tmp_len] = b;
-			tmp_len ++;
+		end = (i + 8 <= len) ? i + 8 : len;
+		for (; i < end; i++) {
+			if (ref[i] != mem[i])
+				Data_DiffAdd(cmp, offset + i);
 		}
+	}
+
+	return cmp->bytes - before;
+}
+
+/*
+ * closes last range, call before using cmp->diff
+ */
+void Data_CompareDone(struct data_cmp_t *cmp)
+{
+	if (cmp->ranges && (cmp->count < cmp->max) && (cmp->count < cmp->ranges)) {
+		cmp->diff[cmp->count++] = cmp->open;
+	}
+}
 
-		byte_count = tmp[0];
-		addr = (tmp[1] << 8) | tmp[2];
-		rec_type = tmp[3];
+void Data_ComparePrint(struct data_cmp_t *cmp)
+{
+	int i;
 
-		if (rec_type == 0x00) {
-			// data record
-			uint16_t i;
-			addr = base_addr | addr;
+	for (i = 0; i < cmp->count; i++) {
+		struct data_diff_t *d = &cmp->diff[i];
 
-			if (out_buf_size < byte_count + addr) {
-				fprintf(stderr, "Data won't fit into buffer (size= %04x want %04x)\n", out_buf_size, byte_count + addr);
-				fclose(fp);
-				return 0;
-			}
+		printf("Diff @0x%06x - 0x%06x (%u of %u bytes differ)\n", d->addr, d->addr + d->len - 1, d->count, d->len);
+	}
 
-			for (i = 0; i < byte_count; i++) {
-				sscanf(p, "%2x", &b);
-				p += 2;
+	if (cmp->ranges > cmp->count) {
+		printf("... %u more ranges\n", cmp->ranges - cmp->count);
+	}
 
-				tmp[tmp_len] = b;
-				tmp_len++;
+	printf("%u bytes differ in %u ranges\n", cmp->bytes, cmp->ranges);
+}
 
-				out_buf[addr + i] = b;
+/*
+ * adds new segment at position idx
+ * own - allocate len bytes for data, otherwise caller sets data
+ */
+static struct data_segment_t *Data_ImageInsert(struct data_image_t *img, int idx, uint32_t addr, uint32_t len, int own)
+{
+	struct data_segment_t *seg;
 
-				if (addr_max < addr + i) {
-					addr_max = addr + i;
-				}
-			}
-		} else if (rec_type == 0x04) {
-			// extended linear: base addr
-			base_addr = 0;
-			for (i = 0; i < byte_count; i++) {
-				sscanf(p, "%2x", &b);
-				p += 2;
-
-				tmp[tmp_len] = b;
-				tmp_len ++;
-				base_addr = (base_addr << 8) | (b & 0xff);
-			}
+	if (img->count == img->alloc) {
+		int alloc = img->alloc ? 2 * img->alloc : 16;
 
-			base_addr <<= 16;
-#ifdef DEBUG
-			fprintf(stderr, "new (linear) base addr = %08x\n", base_addr);
-#endif
-		} else if (rec_type == 0x01) {
-			// end record
-			break;
-		} else {
-			fprintf(stderr, "Unknown record type on line %d\n", line);
-			return 0;
+		seg = realloc(img->seg, alloc * sizeof(struct data_segment_t));
+		if (seg == NULL) {
+			return NULL;
 		}
+		img->seg = seg;
+		img->alloc = alloc;
+	}
 
-		sscanf(p, "%2x", &b);
-		chksum = b;
+	memmove(&img->seg[idx + 1], &img->seg[idx], (img->count - idx) * sizeof(struct data_segment_t));
+	img->count ++;
 
-		// calculate checksum after line was parsed
-		if (Data_Checksum(tmp, tmp_len) != chksum) {
-			fprintf(stderr, "Checksum error on line %d\n", line);
-			return 0;
-		}
+	seg = &img->seg[idx];
+	seg->addr = addr;
+	seg->len = len;
+	seg->alloc = own ? len : 0;
+	seg->data = NULL;
+	if (own && ((seg->data = malloc(len)) == NULL)) {
+		img->count --;
+		memmove(&img->seg[idx], &img->seg[idx + 1], (img->count - idx) * sizeof(struct data_segment_t));
+		return NULL;
 	}
 
-	fclose(fp);
-	return addr_max + 1;
+	return seg;
 }
 
 /*
- * writes hex file
- * file - name of hexfile
- * buf - buffer where data is stored
- * size - size of buffer
+ * copies data into image, data overlapping existing segments wins
+ * img - image
+ * addr - address of data
+ * data - data to be added
+ * len - length of data
  */
-static void HEX_WriteRec(FILE *fp, uint8_t rec_id, uint8_t byte_count, uint16_t addr, uint8_t *data)
+int Data_ImageAdd(struct data_image_t *img, uint32_t addr, const uint8_t *data, uint32_t len)
 {
-	int res;
-	uint8_t bin_line[128];
-	char raw_line[256];
-	uint8_t i=0;
-	uint8_t j;
+	struct data_segment_t *seg;
+	uint32_t end = addr + len;
+	uint32_t lo, hi;
+	uint8_t *buf;
+	int first, last;
+	int i;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	seg = img->count ? &img->seg[img->count - 1] : NULL;
+
+	// data mostly comes in address order, grow last segment
+	if ((seg != NULL) && (seg->alloc != 0) && (addr == seg->addr + seg->len)) {
+		if (seg->len + len > seg->alloc) {
+			uint32_t alloc = 2 * seg->alloc;
 
-	// fill header
-	bin_line[0] = byte_count;
-	bin_line[1] = (addr >> 8) & 0xff;
-	bin_line[2] = addr & 0xff;
-	bin_line[3] = rec_id;
+			if (alloc < seg->len + len)
+				alloc = seg->len + len;
 
-	// copy data
-	for (i=0; i<byte_count; i++) {
-		bin_line[4 + i] = data[i];
+			buf = realloc(seg->data, alloc);
+			if (buf == NULL)
+				goto err;
+
+			seg->data = buf;
+			seg->alloc = alloc;
+		}
+
+		memcpy(seg->data + seg->len, data, len);
+		seg->len += len;
+		return 0;
+	}
+
+	if ((seg == NULL) || (addr > seg->addr + seg->len)) {
+		first = img->count;
+		last = first - 1;
+	} else {
+		// segments touching new data
+		for (first = 0; first < img->count; first++) {
+			if (img->seg[first].addr + img->seg[first].len >= addr)
+				break;
+		}
+		for (last = first; last < img->count; last++) {
+			if (img->seg[last].addr > end)
+				break;
+		}
+		last --;
 	}
 
-	// add checksum
-	bin_line[4 + i] = Data_Checksum(bin_line, 4+i);
+	if (last < first) {
+		// fits into gap
+		seg = Data_ImageInsert(img, first, addr, len, 1);
+		if (seg == NULL)
+			goto err;
 
-	// rewrite bin data to hex
-	res = sprintf(raw_line, ":");
-	for (j = 0; j < 4 + i + 1; j++) {
-		res += sprintf(raw_line + res, "%02X", bin_line[j]);
+		memcpy(seg->data, data, len);
+		return 0;
+	}
+
+	// merge everything touched into one segment
+	lo = (img->seg[first].addr < addr) ? img->seg[first].addr : addr;
+	hi = img->seg[last].addr + img->seg[last].len;
+	hi = (hi > end) ? hi : end;
+
+	buf = malloc(hi - lo);
+	if (buf == NULL)
+		goto err;
+	memset(buf, 0xff, hi - lo);
+
+	for (i = first; i <= last; i++) {
+		seg = &img->seg[i];
+		memcpy(buf + seg->addr - lo, seg->data, seg->len);
+		if (seg->alloc)
+			free(seg->data);
 	}
-	res += sprintf(raw_line + res, "\n");
+	memcpy(buf + addr - lo, data, len);
+
+	seg = &img->seg[first];
+	seg->addr = lo;
+	seg->len = hi - lo;
+	seg->alloc = hi - lo;
+	seg->data = buf;
+
+	memmove(&img->seg[first + 1], &img->seg[last + 1], (img->count - last - 1) * sizeof(struct data_segment_t));
+	img->count -= last - first;
+	img->cur = 0;
+
+	return 0;
 
-	// output to file
-	res = fwrite(raw_line, sizeof(char), res, fp);
+err:
+	fprintf(stderr, "Memory allocation problem\n");
+	return -1;
 }
 
 /*
- * writes hex file
- * file - name of hexfile
- * buf - buffer which contains the data
- * size - size of buffer
+ * adds non-blank parts of buffer to image without copying them
+ * buf - buffer, has to outlive image
+ * size - size of buffer, also becomes size of image
+ * block - granularity of blank check (e.g. page size)
  */
-static int HEX_WriteFile(const char *file, uint8_t *in_buf, uint32_t in_buf_size)
+int Data_ImageWrap(struct data_image_t *img, uint8_t *buf, uint32_t size, uint32_t block)
 {
-	uint32_t written = 0;
-	uint16_t base = 0x0000;
-	uint32_t addr = 0x0000;
-	FILE *fp;
+	struct data_segment_t *seg = NULL;
+	uint32_t addr;
 
-	fp = fopen(file, "w");
+	img->size = size;
 
-	if (fp == NULL) {
-		return -1;
-	}
+	for (addr = 0; addr < size; addr += block) {
+		uint32_t len = (size - addr > block) ? block : size - addr;
 
-	// ext address record
-	HEX_WriteRec(fp, 0x04, 2, 0x0000, (uint8_t*)&base);
+		if (Data_IsBlank(buf + addr, len)) {
+			seg = NULL;
+			continue;
+		}
 
-	while (written < in_buf_size) {
-		uint8_t byte_count;
-		if ((in_buf_size - written) > 0x10) {
-			byte_count = 0x10;
-		} else {
-			byte_count = in_buf_size - written;
+		if (seg != NULL) {
+			seg->len += len;
+			continue;
 		}
 
-		// write data record
-		HEX_WriteRec(fp, 0x00, byte_count, addr, &in_buf[written]);
-		written += byte_count;
-		addr += byte_count;
+		seg = Data_ImageInsert(img, img->count, addr, len, 0);
+		if (seg == NULL) {
+			fprintf(stderr, "Memory allocation problem\n");
+			return -1;
+		}
+		seg->data = buf + addr;
+	}
+
+	return 0;
+}
+
+/*
+ * copies size bytes at addr out of image, gaps read as 0xff
+ * returns 1 if there was any data in range, 0 otherwise
+ */
+int Data_ImageRead(struct data_image_t *img, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+	int found = 0;
+	int i;
 
-		// write ext addr record
-		if (addr & 0x10000) {
-			uint8_t tmp[2];
+	memset(buf, 0xff, size);
 
-			base ++;
+	// callers mostly go forward, start at segment used last time
+	i = img->cur;
+	if ((i >= img->count) || (img->seg[i].addr > addr))
+		i = 0;
 
-			tmp[0] = (base >> 8) & 0xff;
-			tmp[1] = (base & 0xff);
+	while ((i < img->count) && (img->seg[i].addr + img->seg[i].len <= addr))
+		i ++;
+	img->cur = i;
 
-			HEX_WriteRec(fp, 0x04, 2, 0x0000, tmp);
+	for (; (i < img->count) && (img->seg[i].addr < addr + size); i++) {
+		struct data_segment_t *seg = &img->seg[i];
+		uint32_t from = (seg->addr > addr) ? seg->addr : addr;
+		uint32_t to = seg->addr + seg->len;
 
-			addr -= 0x10000;
-		}
+		to = (to < addr + size) ? to : addr + size;
+		memcpy(buf + from - addr, seg->data + from - seg->addr, to - from);
+		found = 1;
 	}
 
-	// end record
-	HEX_WriteRec(fp, 0x01, 0x00, 0x0000, NULL);
+	return found;
+}
 
-	fclose(fp);
-	return 0;
+/*
+ * returns end of image (past last byte)
+ */
+uint32_t Data_ImageEnd(struct data_image_t *img)
+{
+	uint32_t end = 0;
+
+	if (img->count)
+		end = img->seg[img->count - 1].addr + img->seg[img->count - 1].len;
+
+	return (end > img->size) ? end : img->size;
+}
+
+void Data_ImageFree(struct data_image_t *img)
+{
+	int i;
+
+	for (i = 0; i < img->count; i++) {
+		if (img->seg[i].alloc)
+			free(img->seg[i].data);
+	}
+	free(img->seg);
+
+	memset(img, 0, sizeof(struct data_image_t));
 }
 
-static int HEX_CheckType(const char *dummy)
+/*
+ * writes image as plain data from address 0 up to end, gaps as 0xff
+ */
+static int Data_WriteDense(FILE *fp, struct data_image_t *img, uint32_t end)
 {
-	return 0 ;; //TODO: finish
+	uint8_t buf[4096];
+	uint32_t addr;
+
+	for (addr = 0; addr < end; addr += sizeof(buf)) {
+		uint32_t n = (end - addr > sizeof(buf)) ? sizeof(buf) : end - addr;
+
+		Data_ImageRead(img, addr, buf, n);
+		if (fwrite(buf, 1, n, fp) != n) {
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 /*
- * reads bin file
- * file - name of hexfile
- * buf - buffer where the data should be written to
- * size - size of buffer, returns actual size read
+ * maps whole file into memory for reading
+ * file - name of file
+ * size - returns size of file
+ * returns NULL on error, release with Data_UnmapFile()
  */
-static uint32_t BIN_ReadFile(const char *file, uint8_t *out_buf, uint32_t out_buf_size)
+const uint8_t *Data_MapFile(const char *file, uint32_t *size)
 {
-	int res;
-	long fsize;
+	uint8_t *map;
+#if IS_WIN32
 	FILE *fp;
+	long fsize;
 
 	fp = fopen(file, "rb");
 	if (fp == NULL) {
-		return 0;
+		return NULL;
 	}
 
 	fseek(fp, 0, SEEK_END);
 	fsize = ftell(fp);
 	fseek(fp, 0, SEEK_SET);
 
-	if (fsize > out_buf_size) {
-		printf("file won't fit into buffer :(\n");
-		return 0;
+	// never hand out NULL for empty file
+	map = malloc(fsize + 1);
+	if (map == NULL) {
+		fprintf(stderr, "Memory allocation problem\n");
+		fclose(fp);
+		return NULL;
 	}
 
-	res = fread(out_buf, sizeof(uint8_t), fsize, fp);
-	if (res <= 0) {
-		printf("error reading file %s \n", file);
+	if (fread(map, 1, fsize, fp) != fsize) {
+		fprintf(stderr, "error reading file %s\n", file);
+		free(map);
+		fclose(fp);
+		return NULL;
 	}
-
 	fclose(fp);
-	return (res < 0) ? 0 : res;
+
+	*size = fsize;
+#else
+	struct stat st;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		// mmap refuses zero length
+		close(fd);
+		*size = 0;
+		return (const uint8_t *)"";
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	// parsers walk the file once from start to end
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*size = st.st_size;
+#endif
+	return map;
+}
+
+void Data_UnmapFile(const uint8_t *map, uint32_t size)
+{
+#if IS_WIN32
+	free((void *)map);
+#else
+	if (size)
+		munmap((void *)map, size);
+#endif
 }
 
 /*
- * writes bin file
- * file - name of hexfile
- * buf - buffer which contains the data
- * size - size of buffer
+ * opens file for reading page by page
+ * fo - file type
+ * file - name of file
+ * size - largest image the file may hold
+ * buffered - parse whole file now (e.g. when it is shared by more devices)
  */
-static int BIN_WriteFile(const char *file, uint8_t *out_buf, uint32_t out_buf_size)
+int Data_StreamOpen(struct data_stream_t *s, struct file_ops_t *fo, const char *file, uint32_t size, int buffered)
 {
-	FILE *fp;
-	int res;
+	int ret;
 
-	fp = fopen(file, "wb");
-	if (fp == NULL) {
+	memset(s, 0, sizeof(struct data_stream_t));
+	s->fo = fo;
+
+	if (!buffered && (fo->OpenStream != NULL)) {
+		s->map = Data_MapFile(file, &s->map_size);
+		if (s->map == NULL) {
+			fprintf(stderr, "Unable to open file '%s'\n", file);
+			return -1;
+		}
+
+		ret = fo->OpenStream(s);
+		if (ret == 0) {
+			if (s->max_addr > size) {
+				fprintf(stderr, "Data won't fit into buffer (size= %04x want %04x)\n", size, s->max_addr);
+				Data_StreamClose(s);
+				return -1;
+			}
+			return 0;
+		}
+
+		Data_UnmapFile(s->map, s->map_size);
+		s->map = NULL;
+
+		if (ret < 0) {
+			return -1;
+		}
+	}
+
+	// format can't be streamed, parse it whole
+	s->buffered = 1;
+	if (fo->ReadImage(file, &s->img)) {
+		Data_ImageFree(&s->img);
 		return -1;
 	}
-	res = fwrite(out_buf, sizeof(uint8_t), out_buf_size, fp);
-	if (res != out_buf_size) {
-		printf("error writing file %s\n", file);
+
+	s->max_addr = Data_ImageEnd(&s->img);
+	if (s->max_addr > size) {
+		fprintf(stderr, "Data won't fit into buffer (size= %04x want %04x)\n", size, s->max_addr);
+		Data_ImageFree(&s->img);
+		return -1;
 	}
-	fclose(fp);
 
 	return 0;
 }
 
-static int BIN_CheckType(const char *dummy)
+/*
+ * reads next size bytes of image, missing data reads as 0xff
+ * returns 1 if there was any data, 0 for gap, -1 on error
+ */
+int Data_StreamRead(struct data_stream_t *s, uint8_t *buf, uint32_t size)
+{
+	int ret;
+
+	if (!s->buffered) {
+		return s->fo->ReadStream(s, buf, size);
+	}
+
+	ret = Data_ImageRead(&s->img, s->addr, buf, size);
+	s->addr += size;
+	return ret;
+}
+
+/*
+ * starts reading of stream from the beginning again
+ * returns 0 if ok, -1 on error
+ */
+int Data_StreamRewind(struct data_stream_t *s)
+{
+	s->addr = 0;
+
+	if (s->buffered) {
+		s->img.cur = 0;
+		return 0;
+	}
+
+	// file was checked when opened, parser state is just set up again
+	return s->fo->OpenStream(s) ? -1 : 0;
+}
+
+void Data_StreamClose(struct data_stream_t *s)
+{
+	if (s->map != NULL) {
+		Data_UnmapFile(s->map, s->map_size);
+		s->map = NULL;
+	}
+
+	Data_ImageFree(&s->img);
+}
+
+/*
+ * decodes count bytes of hex digits
+ * returns sum of decoded bytes, or -1 on invalid digit
+ */
+static int HEX_Decode(const uint8_t *p, uint8_t *out, int count)
+{
+	uint8_t sum = 0;
+	uint8_t bad = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		uint8_t hi = hex_nibble[p[2 * i]];
+		uint8_t lo = hex_nibble[p[2 * i + 1]];
+
+		// check once at the end, keeps loop free of branches
+		bad |= hi | lo;
+		out[i] = (hi << 4) | (lo & 0x0f);
+		sum += out[i];
+	}
+
+	if (bad & HEX_BAD)
+		return -1;
+
+	return sum;
+}
+
+struct hex_rec_t {
+	uint8_t byte_count;
+	uint16_t addr;
+	uint8_t type;
+	uint8_t sum;         // sum of header bytes
+	const uint8_t *data; // hex digits of data, followed by checksum
+};
+
+/*
+ * parses header of next record and moves past the whole record
+ * pp - parse position
+ * end - end of file
+ * line - record counter, for messages
+ * returns 1 on record, 0 at end of file, -1 on error
+ */
+static int HEX_NextRecord(const uint8_t **pp, const uint8_t *end, struct hex_rec_t *rec, int *line)
+{
+	const uint8_t *p = *pp;
+	uint8_t hdr[4];
+	int sum;
+
+	while ((p < end) && ((*p == '\r') || (*p == '\n') || (*p == ' ') || (*p == '\t'))) {
+		p ++;
+	}
+
+	*pp = p;
+	if (p == end) {
+		return 0;
+	}
+
+	(*line) ++;
+
+	if (*p != ':') {
+		fprintf(stderr, "Not a hex record on line %d\n", *line);
+		return -1;
+	}
+	p ++;
+
+	// byte count (1byte), address (2byte), record type (1byte)
+	if ((end - p < 10) || ((sum = HEX_Decode(p, hdr, 4)) < 0)) {
+		fprintf(stderr, "Invalid record on line %d\n", *line);
+		return -1;
+	}
+	p += 8;
+
+	rec->byte_count = hdr[0];
+	rec->addr = (hdr[1] << 8) | hdr[2];
+	rec->type = hdr[3];
+	rec->sum = sum;
+	rec->data = p;
+
+	// data + checksum
+	if (end - p < 2 * (rec->byte_count + 1)) {
+		fprintf(stderr, "Truncated record on line %d\n", *line);
+		return -1;
+	}
+
+	*pp = p + 2 * (rec->byte_count + 1);
+	return 1;
+}
+
+/*
+ * checks checksum byte, which makes sum of whole record zero
+ * p - hex digits of checksum
+ * sum - sum of header and data bytes
+ */
+static int HEX_CheckSum(const uint8_t *p, uint8_t sum, int line)
+{
+	uint8_t chk;
+
+	if (HEX_Decode(p, &chk, 1) < 0) {
+		fprintf(stderr, "Invalid record on line %d\n", line);
+		return -1;
+	}
+
+	if ((uint8_t)(sum + chk) != 0) {
+		fprintf(stderr, "Checksum error on line %d\n", line);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * handles records which carry no data
+ * base - base address, updated by address records
+ * returns 1 on end record, 0 if ok, -1 on error
+ */
+static int HEX_Control(struct hex_rec_t *rec, uint32_t *base, int line)
+{
+	uint8_t tmp[4];
+	int sum;
+
+	if (rec->type == 0x01) {
+		// end record
+		return 1;
+	} else if ((rec->type == 0x02) || (rec->type == 0x04)) {
+		// extended segment/linear: base addr
+		if (rec->byte_count != 2) {
+			fprintf(stderr, "Invalid address record on line %d\n", line);
+			return -1;
+		}
+
+		sum = HEX_Decode(rec->data, tmp, 2);
+		if ((sum < 0) || HEX_CheckSum(rec->data + 4, rec->sum + sum, line)) {
+			return -1;
+		}
+
+		if (rec->type == 0x02) {
+			*base = ((tmp[0] << 8) | tmp[1]) << 4;
+		} else {
+			*base = ((tmp[0] << 8) | tmp[1]) << 16;
+		}
+#ifdef DEBUG
+		fprintf(stderr, "new base addr = %08x\n", *base);
+#endif
+	} else if ((rec->type == 0x03) || (rec->type == 0x05)) {
+		// start segment/linear address, nothing to load
+		if (rec->byte_count != 4) {
+			fprintf(stderr, "Invalid start address record on line %d\n", line);
+			return -1;
+		}
+
+		sum = HEX_Decode(rec->data, tmp, 4);
+		if ((sum < 0) || HEX_CheckSum(rec->data + 8, rec->sum + sum, line)) {
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Unknown record type on line %d\n", line);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * reads hex file
+ * file - name of hexfile
+ * img - image where the data should be added to
+ */
+static int HEX_ReadImage(const char *file, struct data_image_t *img)
+{
+	struct hex_rec_t rec;
+	const uint8_t *map;
+	const uint8_t *p;
+	uint32_t map_size;
+	uint32_t base_addr = 0;
+	uint8_t tmp[256];
+	int line = 0;
+	int ret;
+
+	map = Data_MapFile(file, &map_size);
+	if (map == NULL) {
+		return -1;
+	}
+
+	HEX_InitTable();
+
+	p = map;
+	while ((ret = HEX_NextRecord(&p, map + map_size, &rec, &line)) > 0) {
+		uint32_t addr;
+		int sum;
+
+		if (rec.type != 0x00) {
+			ret = HEX_Control(&rec, &base_addr, line);
+			if (ret != 0)
+				break;
+			continue;
+		}
+
+		// data record
+		addr = base_addr + rec.addr;
+
+		sum = HEX_Decode(rec.data, tmp, rec.byte_count);
+		if (sum < 0) {
+			fprintf(stderr, "Invalid record on line %d\n", line);
+			ret = -1;
+			break;
+		}
+
+		ret = HEX_CheckSum(rec.data + 2 * rec.byte_count, rec.sum + sum, line);
+		if (ret)
+			break;
+
+		ret = Data_ImageAdd(img, addr, tmp, rec.byte_count);
+		if (ret)
+			break;
+	}
+
+	Data_UnmapFile(map, map_size);
+
+	if (ret < 0) {
+		printf("Error parsing hex file '%s'\n", file);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * checks whole hex file (digits and checksums included) before anything
+ * is erased, finds its end and whether it can be read in address order
+ * returns 1 if records are out of order, file has to be buffered
+ */
+static int HEX_OpenStream(struct data_stream_t *s)
+{
+	struct hex_rec_t rec;
+	const uint8_t *p = s->map;
+	uint32_t base = 0;
+	uint32_t last = 0;
+	uint8_t tmp[256];
+	int line = 0;
+	int ret;
+
+	HEX_InitTable();
+
+	while ((ret = HEX_NextRecord(&p, s->map + s->map_size, &rec, &line)) > 0) {
+		uint32_t addr;
+		int sum;
+
+		if (rec.type != 0x00) {
+			ret = HEX_Control(&rec, &base, line);
+			if (ret != 0)
+				break;
+			continue;
+		}
+
+		sum = HEX_Decode(rec.data, tmp, rec.byte_count);
+		if (sum < 0) {
+			fprintf(stderr, "Invalid record on line %d\n", line);
+			ret = -1;
+			break;
+		}
+
+		ret = HEX_CheckSum(rec.data + 2 * rec.byte_count, rec.sum + sum, line);
+		if (ret)
+			break;
+
+		addr = base + rec.addr;
+		if (addr < last) {
+			return 1;
+		}
+		if (rec.byte_count) {
+			last = addr + rec.byte_count;
+		}
+	}
+
+	if (ret < 0) {
+		return -1;
+	}
+
+	// hex reader reports at least one byte, keep it the same
+	s->max_addr = last ? last : 1;
+	s->pos = s->map;
+	s->base = 0;
+	s->line = 0;
+	s->rec_left = 0;
+	s->done = 0;
+
+	return 0;
+}
+
+/*
+ * decodes next size bytes of image
+ * returns 1 if any record fell into range
+ */
+static int HEX_ReadStream(struct data_stream_t *s, uint8_t *buf, uint32_t size)
+{
+	struct hex_rec_t rec;
+	uint32_t start = s->addr;
+	uint32_t end = s->addr + size;
+	int found = 0;
+	int ret;
+
+	memset(buf, 0xff, size);
+
+	while (1) {
+		uint32_t n;
+		int sum;
+
+		if ((s->rec_left == 0) && !s->done) {
+			// fetch next data record
+			ret = HEX_NextRecord(&s->pos, s->map + s->map_size, &rec, &s->line);
+			if (ret < 0) {
+				return -1;
+			}
+			if (ret == 0) {
+				s->done = 1;
+				break;
+			}
+
+			if (rec.type != 0x00) {
+				ret = HEX_Control(&rec, &s->base, s->line);
+				if (ret < 0)
+					return -1;
+				if (ret == 1)
+					s->done = 1;
+				continue;
+			}
+
+			s->rec = rec.data;
+			s->rec_addr = s->base + rec.addr;
+			s->rec_left = rec.byte_count;
+			s->rec_sum = rec.sum;
+
+			if (s->rec_left == 0) {
+				if (HEX_CheckSum(s->rec, s->rec_sum, s->line))
+					return -1;
+				continue;
+			}
+		}
+
+		// records come in address order (checked on open)
+		if ((s->rec_left == 0) || (s->rec_addr >= end)) {
+			break;
+		}
+
+		n = end - s->rec_addr;
+		if (n > s->rec_left)
+			n = s->rec_left;
+
+		sum = HEX_Decode(s->rec, buf + (s->rec_addr - start), n);
+		if (sum < 0) {
+			fprintf(stderr, "Invalid record on line %d\n", s->line);
+			return -1;
+		}
+
+		s->rec += 2 * n;
+		s->rec_addr += n;
+		s->rec_left -= n;
+		s->rec_sum += sum;
+		found = 1;
+
+		if (s->rec_left == 0) {
+			if (HEX_CheckSum(s->rec, s->rec_sum, s->line))
+				return -1;
+		}
+	}
+
+	s->addr = end;
+	return found;
+}
+
+// longest record: ':' + (5 + 255) * 2 digits + '\n'
+#define HEX_REC_MAX   (1 + (5 + 255) * 2 + 1)
+#define HEX_OUT_SIZE  (64 * 1024)
+
+struct hex_out_t {
+	FILE *fp;
+	int len;
+	int err;
+	char buf[HEX_OUT_SIZE];
+};
+
+static uint8_t hex_rec_len = 16;
+static char hex_digits[256][2];
+
+/*
+ * sets number of data bytes per record written by HEX_WriteImage()
+ * len - 1 to 255
+ */
+int Data_SetHexRecordLength(int len)
+{
+	if ((len < 1) || (len > 255)) {
+		return -1;
+	}
+
+	hex_rec_len = len;
+	return 0;
+}
+
+static void HEX_Flush(struct hex_out_t *out)
+{
+	if (out->len == 0)
+		return;
+
+	if (fwrite(out->buf, 1, out->len, out->fp) != out->len) {
+		out->err = 1;
+	}
+	out->len = 0;
+}
+
+/*
+ * appends one record to output buffer
+ * rec_id - record type
+ * byte_count - number of data bytes
+ * addr - lower 16 bits of address
+ * data - record data
+ */
+static void HEX_WriteRec(struct hex_out_t *out, uint8_t rec_id, uint8_t byte_count, uint16_t addr, uint8_t *data)
+{
+	char *p;
+	uint8_t sum;
+	uint8_t hdr[4];
+	int i;
+
+	if (out->len + HEX_REC_MAX > HEX_OUT_SIZE) {
+		HEX_Flush(out);
+	}
+
+	hdr[0] = byte_count;
+	hdr[1] = (addr >> 8) & 0xff;
+	hdr[2] = addr & 0xff;
+	hdr[3] = rec_id;
+
+	p = out->buf + out->len;
+	*p++ = ':';
+
+	sum = 0;
+	for (i = 0; i < 4; i++) {
+		sum -= hdr[i];
+		*p++ = hex_digits[hdr[i]][0];
+		*p++ = hex_digits[hdr[i]][1];
+	}
+
+	for (i = 0; i < byte_count; i++) {
+		sum -= data[i];
+		*p++ = hex_digits[data[i]][0];
+		*p++ = hex_digits[data[i]][1];
+	}
+
+	*p++ = hex_digits[sum][0];
+	*p++ = hex_digits[sum][1];
+	*p++ = '\n';
+
+	out->len = p - out->buf;
+}
+
+/*
+ * writes hex file, gaps between segments are left out
+ * file - name of hexfile
+ * img - image which contains the data
+ */
+static int HEX_WriteImage(const char *file, struct data_image_t *img)
+{
+	const char digits[] = "0123456789ABCDEF";
+	struct hex_out_t *out;
+	uint32_t base = 0;
+	int ret;
+	int i;
+
+	out = malloc(sizeof(struct hex_out_t));
+	if (out == NULL) {
+		fprintf(stderr, "Memory allocation problem\n");
+		return -1;
+	}
+
+	out->fp = fopen(file, "w");
+	if (out->fp == NULL) {
+		free(out);
+		return -1;
+	}
+	out->len = 0;
+	out->err = 0;
+
+	for (i = 0; i < 256; i++) {
+		hex_digits[i][0] = digits[i >> 4];
+		hex_digits[i][1] = digits[i & 0x0f];
+	}
+
+	for (i = 0; i < img->count; i++) {
+		struct data_segment_t *seg = &img->seg[i];
+		uint32_t addr = seg->addr;
+		uint32_t end = seg->addr + seg->len;
+
+		while (addr < end) {
+			uint32_t byte_count = hex_rec_len;
+
+			// ext address record, only when upper address changes
+			if ((addr >> 16) != base) {
+				uint8_t tmp[2];
+
+				base = addr >> 16;
+				tmp[0] = (base >> 8) & 0xff;
+				tmp[1] = base & 0xff;
+
+				HEX_WriteRec(out, 0x04, 2, 0x0000, tmp);
+			}
+
+			// records never cross 64k boundary
+			if (byte_count > 0x10000 - (addr & 0xffff)) {
+				byte_count = 0x10000 - (addr & 0xffff);
+			}
+			if (byte_count > end - addr) {
+				byte_count = end - addr;
+			}
+
+			// write data record
+			HEX_WriteRec(out, 0x00, byte_count, addr & 0xffff, seg->data + addr - seg->addr);
+			addr += byte_count;
+		}
+	}
+
+	// end record
+	HEX_WriteRec(out, 0x01, 0x00, 0x0000, NULL);
+	HEX_Flush(out);
+
+	if (out->err) {
+		printf("error writing file %s\n", file);
+	}
+
+	ret = out->err ? -1 : 0;
+	fclose(out->fp);
+	free(out);
+	return ret;
+}
+
+/*
+ * checks that file starts with valid hex records, the last record may
+ * be cut by end of buffer
+ */
+static int HEX_CheckType(const uint8_t *buf, uint32_t size)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + size;
+	int records = 0;
+
+	HEX_InitTable();
+
+	while (p < end) {
+		uint8_t tmp[256 + 5];
+		int len;
+
+		if ((*p == '\r') || (*p == '\n') || (*p == ' ') || (*p == '\t')) {
+			p ++;
+			continue;
+		}
+
+		if (*p != ':')
+			return 0;
+		p ++;
+
+		if (end - p < 2)
+			break;
+
+		if (HEX_Decode(p, tmp, 1) < 0)
+			return 0;
+
+		// byte count, address, type, data, checksum
+		len = tmp[0] + 5;
+		if (end - p < 2 * len)
+			break;
+
+		// checksum is left to parser, broken hex file is still hex
+		if (HEX_Decode(p, tmp, len) < 0)
+			return 0;
+
+		p += 2 * len;
+		records ++;
+	}
+
+	return records > 0;
+}
+
+/*
+ * .bit header: field 0 (magic), field 1, then keyed fields
+ * 'a' design, 'b' part, 'c' date, 'd' time - 16bit length + string
+ * 'e' - 32bit length of bitstream, bitstream follows
+ */
+static const uint8_t bit_magic[] = {
+	0x00, 0x09, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x00, 0x00, 0x01
+};
+
+static int bit_reverse = 0;
+
+// part of last .bit file read, written into .bit files made from flash
+static char bit_part[64] = "";
+
+/*
+ * reverses bit order of every byte of bitstream read from or written to
+ * .bit file (for flash layouts loaded LSB first)
+ */
+void Data_SetBitReverse(int enable)
+{
+	bit_reverse = enable;
+}
+
+/*
+ * reverses bits in every byte, 8 bytes at a time
+ */
+static void BIT_Reverse(uint8_t *buf, uint32_t size)
+{
+	uint64_t x;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&x, buf + i, 8);
+		x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+		x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+		x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+		memcpy(buf + i, &x, 8);
+	}
+
+	for (; i < size; i++) {
+		uint8_t b = buf[i];
+
+		b = ((b >> 1) & 0x55) | ((b & 0x55) << 1);
+		b = ((b >> 2) & 0x33) | ((b & 0x33) << 2);
+		buf[i] = (b >> 4) | (b << 4);
+	}
+}
+
+/*
+ * finds bitstream in mapped .bit file
+ * data - returns pointer to bitstream (inside map)
+ * len - returns length of bitstream
+ */
+static int BIT_ParseHeader(const uint8_t *map, uint32_t size, const uint8_t **data, uint32_t *len)
+{
+	const char *part = "?";
+	const uint8_t *p = map + sizeof(bit_magic);
+	const uint8_t *end = map + size;
+
+	if ((size < sizeof(bit_magic)) || (memcmp(map, bit_magic, sizeof(bit_magic)) != 0)) {
+		fprintf(stderr, "Not a bit file\n");
+		return -1;
+	}
+
+	while (end - p >= 3) {
+		uint8_t key = p[0];
+		uint32_t n;
+
+		if (key == 'e') {
+			if (end - p < 5)
+				break;
+
+			n = (p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+			p += 5;
+
+			if (n > end - p) {
+				fprintf(stderr, "Bitstream truncated (want %u, have %u bytes)\n", n, (uint32_t)(end - p));
+				return -1;
+			}
+
+			printf("Bitstream for %s, %u bytes\n", part, n);
+			*data = p;
+			*len = n;
+			return 0;
+		}
+
+		if ((key < 'a') || (key > 'd'))
+			break;
+
+		n = (p[1] << 8) | p[2];
+		p += 3;
+		if (n > end - p)
+			break;
+
+		// strings are zero terminated
+		if ((key == 'b') && (n > 0) && (p[n - 1] == 0)) {
+			part = (const char *)p;
+			snprintf(bit_part, sizeof(bit_part), "%s", part);
+		}
+
+		p += n;
+	}
+
+	fprintf(stderr, "Invalid bit file header\n");
+	return -1;
+}
+
+/*
+ * reads bit file
+ * file - name of bitfile
+ * img - image where the bitstream should be added to
+ */
+static int BIT_ReadImage(const char *file, struct data_image_t *img)
+{
+	const uint8_t *map;
+	const uint8_t *data;
+	uint32_t map_size;
+	uint32_t len;
+	int ret;
+
+	map = Data_MapFile(file, &map_size);
+	if (map == NULL) {
+		return -1;
+	}
+
+	ret = BIT_ParseHeader(map, map_size, &data, &len);
+	if ((ret == 0) && (len == 0)) {
+		fprintf(stderr, "Empty bitstream\n");
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		ret = Data_ImageAdd(img, 0, data, len);
+	}
+
+	if ((ret == 0) && bit_reverse) {
+		BIT_Reverse(img->seg[0].data, len);
+	}
+
+	Data_UnmapFile(map, map_size);
+	return ret;
+}
+
+static int BIT_OpenStream(struct data_stream_t *s)
+{
+	if (BIT_ParseHeader(s->map, s->map_size, &s->pos, &s->max_addr)) {
+		return -1;
+	}
+
+	return (s->max_addr == 0) ? -1 : 0;
+}
+
+static int BIT_ReadStream(struct data_stream_t *s, uint8_t *buf, uint32_t size)
+{
+	uint32_t n = 0;
+
+	if (s->addr < s->max_addr) {
+		n = s->max_addr - s->addr;
+		if (n > size)
+			n = size;
+		memcpy(buf, s->pos + s->addr, n);
+		if (bit_reverse)
+			BIT_Reverse(buf, n);
+	}
+	memset(buf + n, 0xff, size - n);
+
+	s->addr += size;
+	return n > 0;
+}
+
+static int BIT_WriteField(FILE *fp, uint8_t key, const char *str)
+{
+	uint8_t hdr[3];
+	uint16_t n = strlen(str) + 1;
+
+	hdr[0] = key;
+	hdr[1] = n >> 8;
+	hdr[2] = n & 0xff;
+
+	if (fwrite(hdr, 1, 3, fp) != 3)
+		return -1;
+	if (fwrite(str, 1, n, fp) != n)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * writes bitstream, bits are reversed the same way as on read
+ */
+static int BIT_WriteData(FILE *fp, struct data_image_t *img, uint32_t end)
+{
+	uint8_t buf[4096];
+	uint32_t addr;
+
+	for (addr = 0; addr < end; addr += sizeof(buf)) {
+		uint32_t n = (end - addr > sizeof(buf)) ? sizeof(buf) : end - addr;
+
+		Data_ImageRead(img, addr, buf, n);
+		if (bit_reverse)
+			BIT_Reverse(buf, n);
+		if (fwrite(buf, 1, n, fp) != n) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * writes bit file, flash content becomes the bitstream. Part is taken
+ * from .bit file read in this session, left empty otherwise.
+ * file - name of bitfile
+ * img - image which contains the data
+ */
+static int BIT_WriteImage(const char *file, struct data_image_t *img)
+{
+	uint32_t end = Data_ImageEnd(img);
+	char date[16];
+	char tm_str[16];
+	uint8_t len[5];
+	time_t now;
+	FILE *fp;
+	int res = 0;
+
+	fp = fopen(file, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	now = time(NULL);
+	strftime(date, sizeof(date), "%Y/%m/%d", localtime(&now));
+	strftime(tm_str, sizeof(tm_str), "%H:%M:%S", localtime(&now));
+
+	len[0] = 'e';
+	len[1] = (end >> 24) & 0xff;
+	len[2] = (end >> 16) & 0xff;
+	len[3] = (end >> 8) & 0xff;
+	len[4] = end & 0xff;
+
+	if ((fwrite(bit_magic, 1, sizeof(bit_magic), fp) != sizeof(bit_magic)) ||
+	    BIT_WriteField(fp, 'a', "ols-fwloader readback") ||
+	    BIT_WriteField(fp, 'b', bit_part) ||
+	    BIT_WriteField(fp, 'c', date) ||
+	    BIT_WriteField(fp, 'd', tm_str) ||
+	    (fwrite(len, 1, sizeof(len), fp) != sizeof(len)) ||
+	    BIT_WriteData(fp, img, end)) {
+		printf("error writing file %s\n", file);
+		res = -1;
+	}
+
+	fclose(fp);
+	return res;
+}
+
+static int BIT_CheckType(const uint8_t *buf, uint32_t size)
+{
+	return (size >= sizeof(bit_magic)) && (memcmp(buf, bit_magic, sizeof(bit_magic)) == 0);
+}
+
+/*
+ * reads bin file
+ * file - name of hexfile
+ * img - image where the data should be added to
+ */
+static int BIN_ReadImage(const char *file, struct data_image_t *img)
+{
+	const uint8_t *map;
+	uint32_t map_size;
+	int res;
+
+	map = Data_MapFile(file, &map_size);
+	if (map == NULL) {
+		return -1;
+	}
+
+	if (map_size == 0) {
+		printf("error reading file %s \n", file);
+		Data_UnmapFile(map, map_size);
+		return -1;
+	}
+
+	res = Data_ImageAdd(img, 0, map, map_size);
+
+	Data_UnmapFile(map, map_size);
+	return res;
+}
+
+static int BIN_OpenStream(struct data_stream_t *s)
+{
+	s->max_addr = s->map_size;
+	return (s->max_addr == 0) ? -1 : 0;
+}
+
+static int BIN_ReadStream(struct data_stream_t *s, uint8_t *buf, uint32_t size)
+{
+	uint32_t n = 0;
+
+	if (s->addr < s->map_size) {
+		n = s->map_size - s->addr;
+		if (n > size)
+			n = size;
+		memcpy(buf, s->map + s->addr, n);
+	}
+	memset(buf + n, 0xff, size - n);
+
+	s->addr += size;
+	return n > 0;
+}
+
+/*
+ * writes bin file, gaps are filled with 0xff
+ * file - name of hexfile
+ * img - image which contains the data
+ */
+static int BIN_WriteImage(const char *file, struct data_image_t *img)
+{
+	FILE *fp;
+	int res;
+
+	fp = fopen(file, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+	res = Data_WriteDense(fp, img, Data_ImageEnd(img));
+	if (res) {
+		printf("error writing file %s\n", file);
+	}
+	fclose(fp);
+
+	return res;
+}
+
+static int BIN_CheckType(const uint8_t *buf, uint32_t size)
 {
 	/* always binary */
 	return 1;
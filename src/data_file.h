@@ -21,16 +21,118 @@
 #define DATA_FILE_H_
 
 #include <stdint.h>
+
+// bytes looked at when detecting file type
+#define DATA_SNIFF_SIZE 4096
+
+struct data_stream_t;
+
+/*
+ * image as list of segments sorted by address, gaps read as 0xff
+ */
+struct data_segment_t {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t alloc;		// 0 if data is not owned by image
+	uint8_t *data;
+};
+
+struct data_image_t {
+	struct data_segment_t *seg;
+	int count;
+	int alloc;
+
+	uint32_t size;		// plain formats are padded up to this
+	int cur;		// segment used last, for page by page reads
+};
+
+// differences closer than this are reported as one range
+#define DATA_DIFF_GAP 16
+
+struct data_diff_t {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t count;		// differing bytes in range
+};
+
+/*
+ * result of comparing image with flash content
+ */
+struct data_cmp_t {
+	uint32_t bytes;		// differing bytes
+	uint32_t ranges;	// ranges found, may be more than stored
+
+	struct data_diff_t *diff;
+	int max;
+	int count;		// ranges stored in diff
+
+	struct data_diff_t open; // range being extended
+};
+
 struct file_ops_t {
 	char *name;
 
-	uint32_t (*ReadFile)(const char *, uint8_t *, uint32_t);
-	int (*WriteFile)(const char *, uint8_t *, uint32_t);
-	int (*CheckType)(const char *);
+	int (*ReadImage)(const char *, struct data_image_t *);
+	int (*WriteImage)(const char *, struct data_image_t *);
+	// 1 if start of file (first DATA_SNIFF_SIZE bytes) looks like this type
+	int (*CheckType)(const uint8_t *, uint32_t);
+
+	// optional, reading in address order without whole image in memory
+	int (*OpenStream)(struct data_stream_t *);
+	int (*ReadStream)(struct data_stream_t *, uint8_t *, uint32_t);
+};
+
+/*
+ * image read in address order, straight from mapped file when the
+ * format allows it, from fully parsed image otherwise
+ */
+struct data_stream_t {
+	struct file_ops_t *fo;
+
+	const uint8_t *map;
+	uint32_t map_size;
+
+	// set when whole file was parsed
+	int buffered;
+	struct data_image_t img;
+
+	uint32_t max_addr;	// end of data
+	uint32_t addr;		// next address to be read
+
+	// parser state
+	const uint8_t *pos;
+	uint32_t base;
+	int line;
+	int done;
+
+	// data record being consumed
+	const uint8_t *rec;
+	uint32_t rec_addr;
+	uint16_t rec_left;
+	uint8_t rec_sum;
 };
 
 uint8_t Data_Checksum(uint8_t *buf, uint16_t size);
+int Data_IsBlank(uint8_t *buf, uint32_t size);
+int Data_ImageAdd(struct data_image_t *img, uint32_t addr, const uint8_t *data, uint32_t len);
+int Data_ImageWrap(struct data_image_t *img, uint8_t *buf, uint32_t size, uint32_t block);
+int Data_ImageRead(struct data_image_t *img, uint32_t addr, uint8_t *buf, uint32_t size);
+uint32_t Data_ImageEnd(struct data_image_t *img);
+void Data_ImageFree(struct data_image_t *img);
+void Data_CompareInit(struct data_cmp_t *cmp, struct data_diff_t *diff, int max);
+uint32_t Data_Compare(struct data_cmp_t *cmp, const uint8_t *ref, const uint8_t *mem, uint32_t len, uint32_t offset);
+void Data_CompareDone(struct data_cmp_t *cmp);
+void Data_ComparePrint(struct data_cmp_t *cmp);
+const uint8_t *Data_MapFile(const char *file, uint32_t *size);
+void Data_UnmapFile(const uint8_t *map, uint32_t size);
+int Data_SetHexRecordLength(int len);
+void Data_SetBitReverse(int enable);
+int Data_StreamOpen(struct data_stream_t *s, struct file_ops_t *fo, const char *file, uint32_t size, int buffered);
+int Data_StreamRead(struct data_stream_t *s, uint8_t *buf, uint32_t size);
+int Data_StreamRewind(struct data_stream_t *s);
+void Data_StreamClose(struct data_stream_t *s);
 struct file_ops_t *GetFileOps(char *);
+struct file_ops_t *Data_DetectType(const char *file);
 
 #endif
 
@@ -0,0 +1,476 @@
+/*
+ * Part of ols-fwloader - parallel flashing of many devices
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every device is handled by its own worker process, so the per-device
+ * code (which prints and exits freely) needs no changes. The image is
+ * parsed before forking and shared copy-on-write. Workers send stage and
+ * progress messages over a pipe, their stdout/stderr go to a log file.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !IS_WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include "farm.h"
+#include "ols-boot.h"
+#include "ols-usb.h"
+#include "serial.h"
+
+enum {
+	FARM_PENDING = 0,
+	FARM_RUNNING,
+	FARM_DONE,
+};
+
+struct farm_msg_t {
+	char stage[24];
+	uint32_t done;
+	uint32_t total;
+};
+
+struct farm_dev_t {
+	const char *port;
+	int state;
+	int status;
+	int fd;
+	int pid;
+
+	struct farm_msg_t msg;
+	uint64_t start;
+	uint64_t end;
+	char log[32];
+};
+
+// report pipe, valid only in worker
+static int farm_fd = -1;
+static struct farm_msg_t farm_msg;
+
+int Farm_Add(struct farm_t *farm, const char *port)
+{
+	if (farm->count >= FARM_MAX_DEVICES) {
+		fprintf(stderr, "Too many devices (max %d)\n", FARM_MAX_DEVICES);
+		return -1;
+	}
+
+	farm->ports[farm->count++] = strdup(port);
+	return 0;
+}
+
+#if !IS_WIN32 && !IS_DARWIN
+/*
+ * reads hex number from sysfs attribute file
+ * returns 0 if it is missing
+ */
+static unsigned int Farm_SysHex(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	unsigned int val = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+
+	if (fscanf(f, "%x", &val) != 1)
+		val = 0;
+
+	fclose(f);
+	return val;
+}
+#endif
+
+#if !IS_WIN32
+/*
+ * checks that serial port is OLS in application mode, so other CDC-ACM
+ * devices never get erase or write commands
+ */
+static int Farm_IsOLS(const char *port)
+{
+#if !IS_DARWIN
+	char sys[PATH_MAX];
+	char real[PATH_MAX];
+	const char *p;
+
+	// /sys/class/tty/ttyACM0/device/.. is the usb device
+	p = strrchr(port, '/');
+	p = (p == NULL) ? port : p + 1;
+	snprintf(sys, sizeof(sys), "/sys/class/tty/%s/device/..", p);
+
+	if (realpath(sys, real) == NULL)
+		return 0;
+
+	return (Farm_SysHex(real, "idVendor") == OLS_VID) && (Farm_SysHex(real, "idProduct") == OLS_APP_PID);
+#else
+	// no way to tell the usb device behind the port
+	(void)port;
+	return 1;
+#endif
+}
+#endif
+
+/*
+ * adds all devices found
+ * boot - look for devices in bootloader mode instead of serial ports
+ */
+int Farm_Discover(struct farm_t *farm, int boot)
+{
+#if IS_WIN32
+	fprintf(stderr, "Device discovery is not supported on this platform\n");
+	return -1;
+#else
+	int found = 0;
+	int i;
+
+	if (boot) {
+		char paths[FARM_MAX_DEVICES][OLS_USB_PATH_LEN];
+		char port[sizeof(FARM_BOOT_PREFIX) + OLS_USB_PATH_LEN];
+		int n;
+
+		n = BOOT_List(OLS_VID, OLS_PID, paths, FARM_MAX_DEVICES);
+		for (i = 0; i < n; i++) {
+			// path is bounded by its row, so it always fits
+			snprintf(port, sizeof(port), FARM_BOOT_PREFIX "%.*s", OLS_USB_PATH_LEN - 1, paths[i]);
+			if (Farm_Add(farm, port))
+				break;
+			found ++;
+		}
+	} else {
+		glob_t g;
+#if IS_DARWIN
+		const char *pattern = "/dev/cu.usbmodem*";
+#else
+		const char *pattern = "/dev/ttyACM*";
+#endif
+
+		if (glob(pattern, 0, NULL, &g) == 0) {
+			for (i = 0; i < g.gl_pathc; i++) {
+				if (!Farm_IsOLS(g.gl_pathv[i]))
+					continue;
+				if (Farm_Add(farm, g.gl_pathv[i]))
+					break;
+				found ++;
+			}
+			globfree(&g);
+		}
+	}
+
+	printf("Discovered %d devices\n", found);
+	return found;
+#endif
+}
+
+/*
+ * finds usb port path of device behind port, needed to find the same
+ * device again after it re-enumerates in bootloader mode
+ */
+int Farm_UsbPath(const char *port, char *buf, int size)
+{
+	const char *p;
+
+	if (strncmp(port, FARM_BOOT_PREFIX, strlen(FARM_BOOT_PREFIX)) == 0) {
+		snprintf(buf, size, "%s", port + strlen(FARM_BOOT_PREFIX));
+		return 0;
+	}
+
+	if ((strncasecmp(port, OLS_USB_PREFIX ":", strlen(OLS_USB_PREFIX) + 1) == 0) &&
+	    (strchr(port, '-') != NULL)) {
+		snprintf(buf, size, "%s", port + strlen(OLS_USB_PREFIX) + 1);
+		return 0;
+	}
+
+#if !IS_WIN32 && !IS_DARWIN
+	{
+		char sys[PATH_MAX];
+		char real[PATH_MAX];
+		char *c;
+
+		// /sys/class/tty/ttyACM0/device -> .../1-1.2/1-1.2:1.0
+		p = strrchr(port, '/');
+		p = (p == NULL) ? port : p + 1;
+		snprintf(sys, sizeof(sys), "/sys/class/tty/%s/device", p);
+
+		if (realpath(sys, real) == NULL)
+			return -1;
+
+		p = strrchr(real, '/');
+		if (p == NULL)
+			return -1;
+
+		snprintf(buf, size, "%s", p + 1);
+		c = strchr(buf, ':');
+		if (c != NULL)
+			*c = 0;
+
+		return 0;
+	}
+#else
+	(void)p;
+	return -1;
+#endif
+}
+
+#if !IS_WIN32
+static void Farm_Send(void)
+{
+	if (farm_fd < 0)
+		return;
+
+	// messages are smaller than PIPE_BUF, write is atomic
+	if (write(farm_fd, &farm_msg, sizeof(farm_msg)) < 0) {
+		farm_fd = -1;
+	}
+}
+#endif
+
+/*
+ * reports stage of worker (no-op outside farm mode)
+ */
+void Farm_Stage(const char *stage)
+{
+#if !IS_WIN32
+	snprintf(farm_msg.stage, sizeof(farm_msg.stage), "%s", stage);
+	farm_msg.done = 0;
+	farm_msg.total = 0;
+	Farm_Send();
+#endif
+}
+
+/*
+ * reports progress of current stage (no-op outside farm mode)
+ */
+void Farm_Progress(uint32_t done, uint32_t total)
+{
+#if !IS_WIN32
+	farm_msg.done = done;
+	farm_msg.total = total;
+	Farm_Send();
+#endif
+}
+
+#if !IS_WIN32
+static int Farm_Start(struct farm_t *farm, struct farm_dev_t *dev, int idx)
+{
+	int p[2];
+	int log;
+	int pid;
+
+	if (pipe(p)) {
+		perror("pipe");
+		return -1;
+	}
+
+	snprintf(dev->log, sizeof(dev->log), "farm-%d.log", idx);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		// worker
+		close(p[0]);
+		farm_fd = p[1];
+
+		log = open(dev->log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (log >= 0) {
+			dup2(log, 1);
+			dup2(log, 2);
+			close(log);
+		}
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+		Farm_Stage("start");
+		exit(farm->Run(farm->ctx, dev->port, idx));
+	}
+
+	close(p[1]);
+	dev->fd = p[0];
+	dev->pid = pid;
+	dev->state = FARM_RUNNING;
+	dev->start = serial_time_ms();
+	snprintf(dev->msg.stage, sizeof(dev->msg.stage), "start");
+
+	return 0;
+}
+
+static void Farm_Finish(struct farm_dev_t *dev)
+{
+	int st;
+
+	close(dev->fd);
+	dev->fd = -1;
+
+	if ((waitpid(dev->pid, &st, 0) == dev->pid) && WIFEXITED(st)) {
+		dev->status = WEXITSTATUS(st);
+	} else {
+		dev->status = -1;
+	}
+
+	dev->state = FARM_DONE;
+	dev->end = serial_time_ms();
+}
+
+static void Farm_PrintStatus(struct farm_t *farm, struct farm_dev_t *devs, int finished)
+{
+	int i;
+
+	printf("[%d/%d]", finished, farm->count);
+	for (i = 0; i < farm->count; i++) {
+		struct farm_dev_t *dev = &devs[i];
+
+		if (dev->state != FARM_RUNNING)
+			continue;
+
+		if (dev->msg.total) {
+			printf(" %d:%s %u%%", i, dev->msg.stage, dev->msg.done * 100 / dev->msg.total);
+		} else {
+			printf(" %d:%s", i, dev->msg.stage);
+		}
+	}
+	printf("\n");
+	fflush(stdout);
+}
+#endif
+
+/*
+ * runs farm->Run on every device, at most farm->jobs at once
+ * returns number of failed devices
+ */
+int Farm_Run(struct farm_t *farm)
+{
+#if IS_WIN32
+	fprintf(stderr, "Farm mode is not supported on this platform\n");
+	return -1;
+#else
+	struct farm_dev_t devs[FARM_MAX_DEVICES];
+	struct pollfd pfd[FARM_MAX_DEVICES];
+	int map[FARM_MAX_DEVICES];
+	uint64_t start;
+	uint64_t last_print = 0;
+	int jobs = farm->jobs;
+	int next = 0;
+	int running = 0;
+	int finished = 0;
+	int failed = 0;
+	int i;
+
+	if ((jobs <= 0) || (jobs > farm->count))
+		jobs = farm->count;
+
+	memset(devs, 0, sizeof(devs));
+	for (i = 0; i < farm->count; i++) {
+		devs[i].port = farm->ports[i];
+		devs[i].fd = -1;
+	}
+
+	printf("Farm: %d devices, %d at once\n", farm->count, jobs);
+	start = serial_time_ms();
+
+	while (finished < farm->count) {
+		int n = 0;
+
+		while ((running < jobs) && (next < farm->count)) {
+			if (Farm_Start(farm, &devs[next], next)) {
+				devs[next].state = FARM_DONE;
+				devs[next].status = -1;
+				finished ++;
+			} else {
+				running ++;
+			}
+			next ++;
+		}
+
+		for (i = 0; i < farm->count; i++) {
+			if (devs[i].state != FARM_RUNNING)
+				continue;
+			pfd[n].fd = devs[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			map[n] = i;
+			n ++;
+		}
+
+		if (n == 0)
+			continue;
+
+		if (poll(pfd, n, 500) < 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			struct farm_dev_t *dev = &devs[map[i]];
+			struct farm_msg_t msg;
+
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			if (read(dev->fd, &msg, sizeof(msg)) == sizeof(msg)) {
+				dev->msg = msg;
+				continue;
+			}
+
+			// worker is gone
+			Farm_Finish(dev);
+			running --;
+			finished ++;
+		}
+
+		if (serial_time_ms() - last_print >= 1000) {
+			last_print = serial_time_ms();
+			Farm_PrintStatus(farm, devs, finished);
+		}
+	}
+
+	printf("\nFarm summary:\n");
+	for (i = 0; i < farm->count; i++) {
+		struct farm_dev_t *dev = &devs[i];
+		uint64_t ms = dev->end - dev->start;
+
+		if (dev->status != 0)
+			failed ++;
+
+		printf("  %2d %-24s %-6s %4u.%01u s  (last stage: %s, log: %s)\n", i, dev->port,
+			(dev->status == 0) ? "OK" : "FAILED", (unsigned int)(ms / 1000), (unsigned int)(ms % 1000) / 100,
+			dev->msg.stage, dev->log);
+	}
+	printf("%d devices, %d OK, %d failed in %u ms\n", farm->count, farm->count - failed, failed,
+		(unsigned int)(serial_time_ms() - start));
+
+	return failed;
+#endif
+}
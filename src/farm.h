@@ -0,0 +1,48 @@
+/*
+ * Part of ols-fwloader - parallel flashing of many devices
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FARM_H_
+#define FARM_H_
+
+#include <config.h>
+#include <stdint.h>
+
+#define FARM_MAX_DEVICES 64
+
+// prefix of targets that are already in bootloader mode
+#define FARM_BOOT_PREFIX "boot:"
+
+struct farm_t {
+	int jobs;
+	int count;
+	char *ports[FARM_MAX_DEVICES];
+
+	// runs full sequence on one device, in worker process
+	int (*Run)(void *ctx, const char *port, int idx);
+	void *ctx;
+};
+
+int Farm_Add(struct farm_t *farm, const char *port);
+int Farm_Discover(struct farm_t *farm, int boot);
+int Farm_Run(struct farm_t *farm);
+void Farm_Stage(const char *stage);
+void Farm_Progress(uint32_t done, uint32_t total);
+int Farm_UsbPath(const char *port, char *buf, int size);
+
+#endif
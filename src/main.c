@@ -19,17 +19,18 @@
 
 #include <config.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "ols-boot.h"
 #include "ols.h"
+#include "ols-cache.h"
+#include "ols-parts.h"
 #include "data_file.h"
-
-#if IS_WIN32
-#define sleep(n) Sleep((1000 * (n)))
-#endif
+#include "serial.h"
+#include "farm.h"
 
 #define DEFAULT_TYPE "HEX"
 enum {
@@ -47,7 +48,64 @@ enum {
 	DEV_SWITCH = 4,
 };
 
-static int memverify(uint8_t *ref, uint8_t *mem, uint32_t len, uint32_t offset, int verbose);
+struct session_t {
+	uint8_t cmd;
+	uint8_t device;
+	uint16_t vid;
+	uint16_t pid;
+	int debug;
+	int window;
+	int retries;
+	int sparse;
+	int diff_max;
+	int stop_early;
+	int skip_identical;
+	int differential;
+	uint32_t page_limit;
+	int farm;
+
+	struct file_ops_t *fo;
+	char *file_write;
+	char *file_read;
+
+	// wfile, opened (and checked) before any device is touched
+	struct data_stream_t stream;
+};
+
+// page progress, reported to farm supervisor
+static uint32_t progress_done;
+static uint32_t progress_total;
+
+// pages taken from file parser at once
+#define QUEUE_PAGES OLS_WINDOW_MAX
+
+// differing ranges listed when verify fails
+#define DIFF_MAX_DEFAULT 16
+
+// pages without data after which verify stops reading and seeks
+#define VERIFY_GAP_PAGES 16
+
+// long options without short form
+enum {
+	OPT_SKIP_IDENTICAL = 256,
+	OPT_RETRIES,
+	OPT_NO_CACHE,
+	OPT_DIFFERENTIAL,
+};
+
+static const struct option long_opts[] = {
+	{ "skip-if-identical", no_argument, NULL, OPT_SKIP_IDENTICAL },
+	{ "retries", required_argument, NULL, OPT_RETRIES },
+	{ "no-cache", no_argument, NULL, OPT_NO_CACHE },
+	{ "differential", no_argument, NULL, OPT_DIFFERENTIAL },
+	{ NULL, 0, NULL, 0 },
+};
+
+static int stream_pages(struct session_t *s, struct ols_t *ols, uint32_t pages, struct data_cmp_t *cmp);
+static int verify_pages(struct session_t *s, struct ols_t *ols, uint32_t pages, struct data_cmp_t *cmp, int whole);
+static uint32_t image_pages(struct session_t *s, struct ols_t *ols);
+static void print_rate(const char *what, uint32_t bytes, uint64_t start);
+static int run_device(void *ctx, const char *port, int idx);
 
 static void usage()
 {
@@ -63,133 +121,202 @@ static void usage()
 	printf("  -W      - erase and write flash from wfile\n");
 	printf("  -R      - read flash to rfile\n");
 	printf("  -T      - reset device at the end\n\n");
-	printf("  -t type - File type (BIN/HEX) (default: " DEFAULT_TYPE ")\n");
+	printf("  -t type - File type (BIN/HEX/BIT/auto) (default: detected from wfile,\n");
+	printf("            " DEFAULT_TYPE " when there is no wfile)\n");
+	printf("  -b      - reverse bit order of every byte read from or written to BIT file\n");
 	printf("  -w file - file to be read and written to flash\n");
 	printf("  -r file - file where the flash content should be written to\n");
+	printf("  -L num  - Data bytes per record in written HEX file (default: 16)\n");
+	printf("  -D num  - Number of differing ranges listed by verify (default: %d)\n", DIFF_MAX_DEFAULT);
+	printf("  -e      - stop verify at first difference\n");
+	printf("  --skip-if-identical - compare flash with wfile first, erase and write\n");
+	printf("            only if they differ\n");
 	printf("  -d      - be verbose\n");
 
 	printf("BOOT only options: \n");
 	printf("  -p pid  - Set usb PID (default: 0x%04x)\n", OLS_PID);
 	printf("  -v vid  - Set usb VID (default: 0x%04x)\n", OLS_VID);
 	printf("  -n      - enter bootloader first\n");
+	printf("  --differential - erase and write only blocks which differ from wfile\n");
+
+	printf("Farm mode (more than one device): \n");
+	printf("  -P port - may be given many times, \"auto\" finds all devices\n");
+	printf("            (boot:<usb path> selects device already in bootloader)\n");
+	printf("  -j num  - Number of devices flashed at once (default: all)\n");
 
 	printf("APP only options: \n");
-	printf("  -P port - Serial port device\n");
+	printf("  -P port - Serial port device, or usb[:path|serial] for direct USB\n");
 	printf("  -l num  - Limit number of read/written pages to num\n");
+	printf("  -i num  - Number of pages kept in flight (read/write) (default: %d)\n", OLS_WINDOW_DEFAULT);
+	printf("  --retries num - Retries of page failed in transfer (default: %d)\n", OLS_RETRIES_DEFAULT);
+	printf("  --no-cache - do not use (or update) device profile cached by last session\n");
+	printf("  -F file - load flash parts (JEDEC id, geometry, timings) from table file\n");
 	printf("  -S      - run selftest\n");
+	printf("  -s      - sparse write, skip blank (0xff) pages after erase\n");
 	printf("\n");
 }
 
 int main(int argc, char** argv)
 {
-	struct ols_boot_t *ob;
-	struct ols_t *ols;
-
-	uint8_t *bin_buf;
-	uint8_t *bin_buf_tmp;
-	uint32_t bin_buf_size;
-
-	uint16_t vid = OLS_VID;
-	uint16_t pid = OLS_PID;
+	struct session_t s;
+	struct farm_t farm;
 
 	int error = 0;
 	int ret;
-	int i;
-	uint16_t pages;
-	int debug = 0;
+	int discover = 0;
 
 	// aguments
-	struct file_ops_t *fo;
-	char *file_write = NULL;
-	char *file_read = NULL;
-	uint8_t cmd = 0;
 	char *port = NULL;
-	uint8_t device = 0;
-	uint16_t page_limit = 0;
-	uint32_t max_addr = 0;
 
 	// getopt
 	int opt;
 
-	fo = GetFileOps("HEX");
+	memset(&s, 0, sizeof(s));
+	memset(&farm, 0, sizeof(farm));
+
+	s.vid = OLS_VID;
+	s.pid = OLS_PID;
+	s.window = OLS_WINDOW_DEFAULT;
+	s.retries = OLS_RETRIES_DEFAULT;
+	s.diff_max = DIFF_MAX_DEFAULT;
 
 	// parse args
-	while ((opt = getopt(argc, argv, "WRVETSnr:w:v:p:t:P:f:hd")) != -1) {
+	while ((opt = getopt_long(argc, argv, "WRVETSsbenr:w:v:p:t:P:f:F:l:L:D:i:j:hd", long_opts, NULL)) != -1) {
 		switch (opt) {
 			case 'd':
-				debug = 1;
+				s.debug = 1;
 				break;
 			case 'h':
 				usage();
 				exit(1);
 				break;
 			case 'R':
-				cmd |= CMD_READ;
+				s.cmd |= CMD_READ;
 				break;
 			case 'W':
-				cmd |= CMD_WRITE;
+				s.cmd |= CMD_WRITE;
 				break;
 			case 'E':
-				cmd |= CMD_ERASE;
+				s.cmd |= CMD_ERASE;
 				break;
 			case 'V':
-				cmd |= CMD_VERIFY;
+				s.cmd |= CMD_VERIFY;
 				break;
 			case 'T':
-				cmd |= CMD_RESET;
+				s.cmd |= CMD_RESET;
 				break;
 			case 'S':
-				cmd |= CMD_SELFTEST;
+				s.cmd |= CMD_SELFTEST;
+				break;
+			case 's':
+				s.sparse = 1;
 				break;
 			case 'l':
-				page_limit = atoi(optarg);
+				s.page_limit = atoi(optarg);
+				break;
+			case 'b':
+				Data_SetBitReverse(1);
+				break;
+			case 'e':
+				s.stop_early = 1;
+				break;
+			case OPT_SKIP_IDENTICAL:
+				s.skip_identical = 1;
+				break;
+			case OPT_RETRIES:
+				s.retries = atoi(optarg);
+				if (s.retries < 0) {
+					fprintf(stderr, "Invalid number of retries\n");
+					exit(-1);
+				}
+				break;
+			case OPT_NO_CACHE:
+				OLS_CacheEnable(0);
+				break;
+			case OPT_DIFFERENTIAL:
+				s.differential = 1;
+				break;
+			case 'D':
+				s.diff_max = atoi(optarg);
+				if (s.diff_max < 0) {
+					fprintf(stderr, "Invalid number of ranges\n");
+					exit(-1);
+				}
+				break;
+			case 'F':
+				if (OLS_PartLoad(optarg)) {
+					exit(1);
+				}
+				break;
+			case 'L':
+				if (Data_SetHexRecordLength(atoi(optarg))) {
+					fprintf(stderr, "Record length must be 1 - 255\n");
+					exit(-1);
+				}
+				break;
+			case 'i':
+				s.window = atoi(optarg);
+				if ((s.window < 1) || (s.window > OLS_WINDOW_MAX)) {
+					fprintf(stderr, "Window must be 1 - %d\n", OLS_WINDOW_MAX);
+					exit(-1);
+				}
+				break;
+			case 'j':
+				farm.jobs = atoi(optarg);
 				break;
 			case 'v': // vid
-				vid = (uint16_t)strtol(optarg, NULL, 0);
+				s.vid = (uint16_t)strtol(optarg, NULL, 0);
 				break;
 			case 'p': // pid
-				pid = (uint16_t)strtol(optarg, NULL, 0);
+				s.pid = (uint16_t)strtol(optarg, NULL, 0);
 				break;
 			case 'P':
-				if (port != NULL) {
-					fprintf(stderr, "Two ports ?!\n");
+				if (strcasecmp(optarg, "auto") == 0) {
+					discover = 1;
+					break;
+				}
+				if (Farm_Add(&farm, optarg)) {
 					exit(-1);
 				}
-				port = strdup(optarg);
+				port = farm.ports[0];
 				break;
 			case 'r': // readfile
-				if (file_read != NULL) {
+				if (s.file_read != NULL) {
 					fprintf(stderr, "Two files?\n");
 					exit(-1);
 				}
-				file_read = strdup(optarg);
+				s.file_read = strdup(optarg);
 				break;
 			case 'w': // readfile
-				if (file_write != NULL) {
+				if (s.file_write != NULL) {
 					fprintf(stderr, "Two files?\n");
 					exit(-1);
 				}
-				file_write = strdup(optarg);
+				s.file_write = strdup(optarg);
 				break;
 			case 't':
-				fo = GetFileOps(optarg);
-				if (fo == NULL) {
+				if (strcasecmp(optarg, "auto") == 0) {
+					s.fo = NULL;
+					break;
+				}
+				s.fo = GetFileOps(optarg);
+				if (s.fo == NULL) {
 					fprintf(stderr, "Unknown type \n");
 					exit(-1);
 				}
 				break;
 			case 'n':
-				device |= DEV_SWITCH;
+				s.device |= DEV_SWITCH;
 				break;
 			case 'f':
-				if (device & (DEV_APP | DEV_BOOT)) {
+				if (s.device & (DEV_APP | DEV_BOOT)) {
 					fprintf(stderr, "Two devices ??\n");
 					exit(-1);
 				}
 				if (strncasecmp(optarg, "APP", 3) == 0) {
-					device |= DEV_APP;
+					s.device |= DEV_APP;
 				} else if (strncasecmp(optarg, "BOOT", 4) == 0) {
-					device |= DEV_BOOT;
+					s.device |= DEV_BOOT;
 				} else {
 					fprintf(stderr, "Unknown device specified\n");
 					exit(-1);
@@ -198,34 +325,45 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (discover) {
+		// bootloader devices are found on usb, the rest by serial port
+		Farm_Discover(&farm, (s.device & DEV_BOOT) && !(s.device & DEV_SWITCH));
+		port = farm.ports[0];
+	}
+
 	// check parameters
-	if ((cmd & CMD_READ) && (file_read == NULL)) {
+	if ((s.cmd & CMD_READ) && (s.file_read == NULL)) {
 		fprintf(stderr, "Read command but no file ? \n");
 		error = 1;
 	}
 
-	if ((cmd & CMD_WRITE) && (file_write == NULL)) {
+	if ((s.cmd & CMD_WRITE) && (s.file_write == NULL)) {
 		fprintf(stderr, "Write command but no file ? \n");
 		error = 1;
 	}
 
-	if ((cmd & CMD_VERIFY) && (file_write == NULL)) {
+	if ((s.cmd & CMD_VERIFY) && (s.file_write == NULL)) {
 		fprintf(stderr, "Verify command but no file ? \n");
 		error = 1;
 	}
 
-	if ((device & DEV_APP) || device & DEV_SWITCH) {
+	if ((s.device & DEV_APP) || s.device & DEV_SWITCH) {
 		if (port == NULL) {
 			fprintf(stderr, "Missing serial port \n");
 			error = 1;
 		}
 	}
 
-	if ((device & 3) == 0) {
+	if ((s.device & 3) == 0) {
 		fprintf(stderr, "No device specified\n");
 		error = 1;
 	}
 
+	if (discover && (farm.count == 0)) {
+		fprintf(stderr, "No devices found\n");
+		error = 1;
+	}
+
 /*
 	if (cmd == 0) {
 		fprintf(stderr, "Missing command\n");
@@ -238,10 +376,128 @@ int main(int argc, char** argv)
 		exit(1);
 	}
 
+	s.farm = discover || (farm.count > 1);
+
+	// file type from content of wfile, same type is used for rfile
+	if (s.fo == NULL) {
+		if (s.file_write != NULL) {
+			s.fo = Data_DetectType(s.file_write);
+			if (s.fo == NULL) {
+				exit(1);
+			}
+			printf("Detected %s file\n", s.fo->name);
+		} else {
+			s.fo = GetFileOps(DEFAULT_TYPE);
+		}
+	}
+
+	// JaWi: first read the entire data file before going to erase/write stuff.
+	// This way, we're fairly sure we can leave the device in a workable state
+	// Single APP device gets the file page by page while flashing, but
+	// the whole file (HEX data and checksums included) is validated here
+	// first. Farm parses it once for all devices, bootloader writes it
+	// at once.
+	if (s.cmd & (CMD_WRITE | CMD_VERIFY)) {
+		uint32_t size;
+
+		if (s.device & DEV_BOOT) {
+			size = OLS_FLASH_TOTSIZE;
+		} else {
+			size = OLS_MaxFlashSize();
+		}
+
+		printf("Reading file '%s'\n", s.file_write);
+		if (Data_StreamOpen(&s.stream, s.fo, s.file_write, size, s.farm || (s.device & DEV_BOOT))) {
+			// error reading
+			fprintf(stderr, "Error reading file - skipping write\n");
+			exit(1);
+		}
+	}
+
+	if (s.farm) {
+		farm.Run = run_device;
+		farm.ctx = &s;
+
+		ret = Farm_Run(&farm);
+	} else {
+		ret = run_device(&s, port, -1);
+	}
+
+	Data_StreamClose(&s.stream);
+
+	return ret ? 1 : 0;
+}
+
+static void page_progress(struct ols_t *ols, uint32_t page)
+{
+	progress_done ++;
+	if (((progress_done % 32) == 0) || (progress_done == progress_total)) {
+		Farm_Progress(progress_done, progress_total);
+	}
+}
+
+static void start_stage(struct session_t *s, const char *stage, uint32_t total)
+{
+	if (!s->farm)
+		return;
+
+	progress_done = 0;
+	progress_total = total;
+	Farm_Stage(stage);
+}
+
+/*
+ * runs all requested commands on single device
+ * port - serial port (may be NULL for BOOT only)
+ * idx - index of device in farm, -1 if not in farm mode
+ */
+static int run_device(void *ctx, const char *port, int idx)
+{
+	struct session_t *s = ctx;
+	struct ols_boot_t *ob;
+	struct ols_t *ols;
+
+	uint8_t *bin_buf;
+	uint32_t flash_size;
+
+	uint8_t cmd = s->cmd;
+	uint8_t device = s->device;
+	uint32_t page_limit = s->page_limit;
+	uint32_t max_addr = s->stream.max_addr;
+	uint8_t *image = NULL;
+	int debug = s->debug;
+	int failed = 0;
+	int ret;
+	int i;
+	uint32_t pages;
+	uint64_t t_start;
+
+	char usb_path[OLS_USB_PATH_LEN];
+	const char *path = NULL;
+
+	struct data_diff_t *diff;
+	struct data_cmp_t cmp;
+
+	diff = malloc((s->diff_max + 1) * sizeof(struct data_diff_t));
+	if (diff == NULL) {
+		fprintf(stderr, "Error allocating memory \n");
+		exit(1);
+	}
+	Data_CompareInit(&cmp, diff, s->diff_max);
+
+	// bootloader device has to be found by its usb port when there
+	// are more of them
+	if ((port != NULL) && (s->farm || (strncmp(port, FARM_BOOT_PREFIX, strlen(FARM_BOOT_PREFIX)) == 0))) {
+		if (Farm_UsbPath(port, usb_path, sizeof(usb_path)) == 0) {
+			path = usb_path;
+		}
+	}
+
 	// execute commands
 	// Working with APP or switch to bootloader first
 	if ((device & DEV_APP) || (device & DEV_SWITCH)) {
-		ols = OLS_Init(port, 921600);
+		start_stage(s, "connect", 0);
+		ols = OLS_Init((char *)port, 921600);
 
 		if (ols == NULL) {
 			fprintf(stderr, "Unable to initialise OLS\n");
@@ -251,15 +507,22 @@ int main(int argc, char** argv)
 		if (debug) {
 			ols->verbose = 1;
 		}
+		ols->window = s->window;
+		ols->retries = s->retries;
+		if (s->farm) {
+			ols->progress = page_progress;
+		}
 
-		bin_buf_size = ols->flash->pages * ols->flash->page_size;
+		flash_size = ols->flash->pages * ols->flash->page_size;
 		if (device & DEV_SWITCH) {
 			if (device & DEV_BOOT) {
+				if (s->farm && (path == NULL)) {
+					fprintf(stderr, "Unable to find USB path of '%s'\n", port);
+					exit(1);
+				}
+
 				OLS_EnterBootloader(ols);
 				OLS_Deinit(ols);
-
-				// wait for device to appear
-				sleep(2);
 			} else {
 				fprintf(stderr, "Not switching to bootloader.\n");
 				device &= ~DEV_SWITCH;
@@ -269,7 +532,16 @@ int main(int argc, char** argv)
 
 	// Initialize bootloader
 	if (device & DEV_BOOT) {
-		ob = BOOT_Init(vid, pid, debug);
+		start_stage(s, "boot", 0);
+		if (device & DEV_SWITCH) {
+			// device re-enumerates in bootloader mode, take it as soon as it is there
+			t_start = serial_time_ms();
+			ob = BOOT_Wait(s->vid, s->pid, path, debug, BOOT_TIMEOUT_SWITCH);
+			if (ob != NULL)
+				printf("Bootloader ready in %u ms\n", (unsigned int)(serial_time_ms() - t_start));
+		} else {
+			ob = BOOT_Init(s->vid, s->pid, path, debug);
+		}
 		if (ob == NULL) {
 			exit(1);
 		}
@@ -282,19 +554,37 @@ int main(int argc, char** argv)
 			}
 		}
 
-		bin_buf_size = OLS_FLASH_TOTSIZE;
+		flash_size = OLS_FLASH_TOTSIZE;
 	}
 
-	// allocate buffers
-	bin_buf = malloc(bin_buf_size);
-	bin_buf_tmp = malloc(bin_buf_size);
-	if ((bin_buf == NULL) || (bin_buf_tmp == NULL)) {
-		fprintf(stderr, "Error allocating memory \n");
+	if (max_addr > flash_size) {
+		fprintf(stderr, "Data won't fit into flash (size= %04x want %04x)\n", flash_size, max_addr);
 		exit(1);
 	}
 
+	// only readback of whole flash needs full size buffer
+	bin_buf = NULL;
+	if ((cmd & CMD_READ) || ((cmd & CMD_VERIFY) && (device & DEV_BOOT))) {
+		bin_buf = malloc(flash_size);
+		if (bin_buf == NULL) {
+			fprintf(stderr, "Error allocating memory \n");
+			exit(1);
+		}
+	}
+
+	// bootloader takes whole application at once
+	if ((device & DEV_BOOT) && (cmd & (CMD_WRITE | CMD_VERIFY))) {
+		image = malloc(OLS_FLASH_TOTSIZE);
+		if (image == NULL) {
+			fprintf(stderr, "Error allocating memory \n");
+			exit(1);
+		}
+		Data_ImageRead(&s->stream.img, 0, image, OLS_FLASH_TOTSIZE);
+	}
+
 	if (cmd & CMD_SELFTEST) {
 		if (device & DEV_APP) {
+			start_stage(s, "selftest", 0);
 			ret = OLS_RunSelftest(ols);
 			if (ret) {
 				exit(1);
@@ -303,56 +593,95 @@ int main(int argc, char** argv)
 	}
 
 	if (cmd & CMD_READ) {
+		struct data_image_t rimg;
+		char name[256];
+
 		printf("Reading flash \n");
-		memset(bin_buf, 0xff, bin_buf_size);
+		memset(bin_buf, 0xff, flash_size);
 
 		if (device & DEV_APP) {
-			int i;
 			if (page_limit != 0) {
 				pages = page_limit;
 			} else {
 				pages = ols->flash->pages;
 			}
 			pages = (pages > ols->flash->pages) ? ols->flash->pages : pages;
-			for (i = 0; i < pages; i ++) {
-				// read i-th page into buffer
-				ret = OLS_FlashRead(ols, i, bin_buf + (ols->flash->page_size * i));
-				if (ret) {
-					exit(1);
-				}
-				if ((i % 32) == 0) {
-					printf(".");
-					fflush(stdout);
-				}
-			}
+			start_stage(s, "read", pages);
+			t_start = serial_time_ms();
+			ret = OLS_FlashReadMulti(ols, 0, pages, bin_buf);
 			printf("\n");
+			if (ret != pages) {
+				exit(1);
+			}
+			print_rate("Read", pages * ols->flash->page_size, t_start);
 		} else {
 			// reads whole flash (inc bootloader)
-			ret = BOOT_Read(ob, 0x0000, bin_buf, bin_buf_size);
+			start_stage(s, "read", 0);
+			ret = BOOT_Read(ob, 0x0000, bin_buf, flash_size);
 			if (ret) {
 				exit(1);
 			}
 		}
-		printf("Writing file '%s'\n", file_read);
-		fo->WriteFile(file_read, bin_buf, bin_buf_size);
+
+		// every device in farm gets its own file
+		if (idx >= 0) {
+			snprintf(name, sizeof(name), "%s.%d", s->file_read, idx);
+		} else {
+			snprintf(name, sizeof(name), "%s", s->file_read);
+		}
+		// blank (erased) parts are left out of image
+		memset(&rimg, 0, sizeof(rimg));
+		if (Data_ImageWrap(&rimg, bin_buf, flash_size, (device & DEV_APP) ? ols->flash->page_size : 64)) {
+			exit(1);
+		}
+
+		printf("Writing file '%s'\n", name);
+		s->fo->WriteImage(name, &rimg);
+		Data_ImageFree(&rimg);
 	}
 
-	// JaWi: first read the entire data file before going to erase/write stuff.
-	// This way, we're fairly sure we can leave the device in a workable state
-	if (cmd & CMD_WRITE) {
-		printf("Reading file '%s'\n", file_write);
-		memset(bin_buf_tmp, 0xff, bin_buf_size);
+	// device which already holds the file needs neither erase nor write,
+	// pages are compared as they arrive until first difference
+	if (s->skip_identical && (cmd & CMD_WRITE) && (max_addr != 0) && (device & DEV_APP)) {
+		pages = image_pages(s, ols);
 
-		max_addr = fo->ReadFile(file_write, bin_buf, bin_buf_size);
-		if (max_addr == 0) {
-			// error reading
-			fprintf(stderr, "Error reading file - skipping write\n");
+		printf("Comparing flash with file ...\n");
+		start_stage(s, "compare", pages);
+		t_start = serial_time_ms();
+		ret = verify_pages(s, ols, pages, &cmp, 1);
+		if (ret < 0) {
+			exit(1);
+		}
+
+		if (ret == 0) {
+			print_rate("Read", pages * ols->flash->page_size, t_start);
+			printf("Flash content is identical, skipping erase and write\n");
+			if (cmd & CMD_VERIFY) {
+				printf("Verify OK\n");
+			}
+			cmd &= ~(CMD_ERASE | CMD_WRITE | CMD_VERIFY);
+		} else {
+			printf("Flash content differs\n");
+			if (Data_StreamRewind(&s->stream)) {
+				exit(1);
+			}
+		}
+	}
+
+	// bootloader erases and writes only blocks which differ
+	if (s->differential && (cmd & CMD_WRITE) && (max_addr != 0) && (device & DEV_BOOT)) {
+		printf("Updating flash ... (0x%04x - 0x%04x) \n", OLS_FLASH_ADDR, OLS_FLASH_ADDR + OLS_FLASH_SIZE);
+		start_stage(s, "write", 0);
+		ret = BOOT_Update(ob, image);
+		if (ret) {
 			exit(1);
 		}
+		cmd &= ~(CMD_ERASE | CMD_WRITE);
 	}
 
 	// writing implies erase
 	if ((cmd & CMD_ERASE) || (cmd & CMD_WRITE)) {
+		start_stage(s, "erase", 0);
 		printf("Erasing flash ...\n");
 		if (device & DEV_APP) {
 			// erase spi flash, bulk erase
@@ -369,34 +698,52 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if (cmd & CMD_WRITE) {
-		if ((max_addr != 0) && (device & DEV_APP)) {
-			int i;
-			// determine number of pages (round up)
-			if (page_limit != 0) {
-				pages = page_limit;
-			} else {
-				pages = (max_addr + ols->flash->page_size - 1) / ols->flash->page_size;
-			}
-			pages = (pages > ols->flash->pages) ? ols->flash->pages : pages;
+	// file goes to device page by page, verify compares pages as they
+	// are read back
+	if ((cmd & (CMD_WRITE | CMD_VERIFY)) && (max_addr != 0) && (device & DEV_APP)) {
+		pages = image_pages(s, ols);
+
+		if (cmd & CMD_WRITE) {
 			printf("Will write %d pages \n", pages);
-			for (i = 0; i < pages; i ++) {
-				ret = OLS_FlashWrite(ols, i, bin_buf + (ols->flash->page_size * i));
-				if (ret) {
-					exit(1);
-				}
-				if ((i % 32) == 0) {
-					printf(".");
-					fflush(stdout);
-				}
+			start_stage(s, "write", (cmd & CMD_VERIFY) ? 2 * pages : pages);
+		} else {
+			// pages skipped by sparse write are compared against
+			// the 0xff fill, so they are expected to be erased
+			printf("Checking flash ...\n");
+			start_stage(s, "verify", pages);
+		}
+
+		t_start = serial_time_ms();
+		if (cmd & CMD_WRITE) {
+			ret = stream_pages(s, ols, pages, &cmp);
+		} else {
+			ret = verify_pages(s, ols, pages, &cmp, 0);
+		}
+		if (ret < 0) {
+			exit(1);
+		}
+		print_rate((cmd & CMD_WRITE) ? ((cmd & CMD_VERIFY) ? "Write+verify" : "Write") : "Read", pages * ols->flash->page_size, t_start);
+
+		if (cmd & CMD_VERIFY) {
+			if (ret) {
+				Data_CompareDone(&cmp);
+				Data_ComparePrint(&cmp);
+				printf("Verify error\n");
+				failed = 1;
+			} else {
+				printf("Verify OK\n");
 			}
-			printf("\n");
-		} else if ((max_addr != 0) && (device & DEV_BOOT)) {
+		}
+	}
+
+	if (cmd & CMD_WRITE) {
+		if ((max_addr != 0) && (device & DEV_BOOT)) {
 			int size;
 			// we write only application
 			size = ((max_addr - OLS_FLASH_ADDR) > OLS_FLASH_SIZE)? OLS_FLASH_SIZE : max_addr - OLS_FLASH_ADDR;
 			printf("Writing flash ... (0x%04x - 0x%04x) \n", OLS_FLASH_ADDR, size + OLS_FLASH_ADDR);
-			ret = BOOT_Write(ob, OLS_FLASH_ADDR, &bin_buf[OLS_FLASH_ADDR], size);
+			start_stage(s, "write", 0);
+			ret = BOOT_Write(ob, OLS_FLASH_ADDR, &image[OLS_FLASH_ADDR], size);
 			if (ret) {
 				exit(1);
 			}
@@ -404,49 +751,11 @@ int main(int argc, char** argv)
 	}
 
 	if (cmd & CMD_VERIFY) {
-		// read the whole flash
-		memset(bin_buf_tmp, 0xff, bin_buf_size);
-		memset(bin_buf, 0xff, bin_buf_size);
-
-		max_addr = fo->ReadFile(file_write, bin_buf_tmp, bin_buf_size);
-		if (max_addr == 0) {
-			// error reading
-			fprintf(stderr, "Error reading file - skipping verify\n");
-		}
-
-		if ((max_addr != 0) && (device & DEV_APP)) {
-			int i;
-
-			printf("Checking flash ...\n");
-
-			if (page_limit != 0) {
-				pages = page_limit;
-			} else {
-				pages = (max_addr + ols->flash->page_size - 1) / ols->flash->page_size;
-			}
-			pages = (pages > ols->flash->pages) ? ols->flash->pages : pages;
-			for (i = 0; i < pages; i ++) {
-				uint32_t off;
-				off = ols->flash->page_size * i;
-				// read i-th page into buffer
-				ret = OLS_FlashRead(ols, i, bin_buf + off);
-				if (ret) {
-					exit(1);
-				}
-				if ((i % 32) == 0) {
-					printf(".");
-					fflush(stdout);
-				}
-			}
-			printf("\n");
-			// compare page by page
-			if (memverify(bin_buf_tmp, bin_buf, max_addr, 0, debug)) {
-				printf("Verify error\n");
-			} else {
-				printf("Verify OK\n");
-			}
-		} else if ((max_addr != 0) && (device & DEV_BOOT)) {
+		if ((max_addr != 0) && (device & DEV_BOOT)) {
 			int size;
+			// read the whole flash
+			memset(bin_buf, 0xff, flash_size);
+			start_stage(s, "verify", 0);
 			ret = BOOT_Read(ob, 0x0000, bin_buf, OLS_FLASH_TOTSIZE);
 			if (ret) {
 				exit(1);
@@ -455,15 +764,19 @@ int main(int argc, char** argv)
 			size = ((max_addr - OLS_FLASH_ADDR) > OLS_FLASH_SIZE)? OLS_FLASH_SIZE : max_addr - OLS_FLASH_ADDR;
 			printf("Checking flash ... (0x%04x - 0x%04x)\n", OLS_FLASH_ADDR, size + OLS_FLASH_ADDR);
 
-			if (memverify(&bin_buf_tmp[OLS_FLASH_ADDR], &bin_buf[OLS_FLASH_ADDR], size, OLS_FLASH_ADDR, debug) == 0) {
+			if (Data_Compare(&cmp, &image[OLS_FLASH_ADDR], &bin_buf[OLS_FLASH_ADDR], size, OLS_FLASH_ADDR) == 0) {
 				printf("Verified OK! :)\n");
 			} else {
+				Data_CompareDone(&cmp);
+				Data_ComparePrint(&cmp);
 				printf("Verify failed :(\n");
+				failed = 1;
 			}
 		}
 	}
 
 	if (cmd & CMD_RESET) {
+		start_stage(s, "reset", 0);
 		if (device & DEV_APP) {
 			printf("Reseting to normal mode \n");
 			OLS_EnterRunMode(ols);
@@ -474,31 +787,401 @@ int main(int argc, char** argv)
 	}
 
 	if (device & DEV_APP) {
+		if (ols->retried) {
+			printf("Survived %u page retries (%u resyncs)\n", ols->retried, ols->resynced);
+		}
+		if (debug) {
+			OLS_ProfilePrint(ols);
+		}
 		OLS_Deinit(ols);
 	} else {
 		BOOT_Deinit(ob);
 	}
 
 	// free allocated memory
-	free(bin_buf_tmp);
 	free(bin_buf);
+	free(image);
+	free(diff);
 
-	return 0;
+	start_stage(s, failed ? "verify failed" : "done", 0);
+	return failed;
 }
 
-static int memverify(uint8_t *ref, uint8_t *mem, uint32_t len, uint32_t offset, int verbose)
+/*
+ * number of flash pages covered by file (or page limit)
+ */
+static uint32_t image_pages(struct session_t *s, struct ols_t *ols)
 {
-	int ret = 0;
+	uint32_t pages;
+
+	// round up
+	if (s->page_limit != 0) {
+		pages = s->page_limit;
+	} else {
+		pages = (s->stream.max_addr + ols->flash->page_size - 1) / ols->flash->page_size;
+	}
+
+	return (pages > ols->flash->pages) ? ols->flash->pages : pages;
+}
+
+struct readback_t {
+	struct session_t *s;
+	uint8_t *data;		// file data of first page
+	uint8_t *readback;	// final read back data of pages, from first page
+	uint8_t *got;		// page has its final read back data
+	uint32_t page;		// first page
+	uint16_t ps;
+	int failed;
+	int stop;		// verify stopped at stop_page
+	uint32_t stop_page;
+};
+
+/*
+ * checks page read back right after it was written, final data is kept
+ * to be compared in page order once the whole queue is done
+ * returns non-zero if it differs
+ */
+static int readback_page(void *ctx, uint32_t page, uint8_t *data, int last)
+{
+	struct readback_t *r = ctx;
+	uint32_t max_addr = r->s->stream.max_addr;
+	uint32_t addr = page * r->ps;
+	uint32_t len = r->ps;
+	uint32_t idx = page - r->page;
+	uint8_t *ref = r->data + idx * r->ps;
+
+	// compare only up to end of file data
+	if (addr + len > max_addr) {
+		len = (addr < max_addr) ? max_addr - addr : 0;
+	}
+
+	// page will be written again, nothing to report yet
+	if (!last)
+		return memcmp(ref, data, len) != 0;
+
+	memcpy(r->readback + idx * r->ps, data, r->ps);
+	r->got[idx] = 1;
+
+	if (memcmp(ref, data, len) == 0)
+		return 0;
+
+	r->failed = 1;
+	r->stop = r->s->stop_early;
+	r->stop_page = page;
+	return r->stop;
+}
+
+/*
+ * writes pages as they come out of file parser, through queue of
+ * QUEUE_PAGES, so memory use does not depend on flash size. With verify
+ * every page is read back right after it was written.
+ * pages without any data in file are neither written nor compared
+ * returns 0 if ok, 1 on verify error, -1 on failure
+ */
+static int stream_pages(struct session_t *s, struct ols_t *ols, uint32_t pages, struct data_cmp_t *cmp)
+{
+	uint16_t ps = ols->flash->page_size;
+	uint32_t max_addr = s->stream.max_addr;
+	uint8_t has_data[QUEUE_PAGES];
+	uint8_t write[QUEUE_PAGES];
+	uint8_t got[QUEUE_PAGES];
+	struct readback_t rb;
+	uint8_t *queue;
+	uint8_t *readback;
+	uint32_t skipped = 0;
+	uint32_t page;
+	uint32_t first, last;
+	uint32_t n;
 	uint32_t i;
+	int failed = 0;
+	int stop = 0;
+	int ret;
+
+	queue = malloc(2 * QUEUE_PAGES * ps);
+	if (queue == NULL) {
+		fprintf(stderr, "Error allocating memory \n");
+		return -1;
+	}
+	readback = queue + QUEUE_PAGES * ps;
+
+	memset(&rb, 0, sizeof(rb));
+	rb.s = s;
+	rb.data = queue;
+	rb.readback = readback;
+	rb.got = got;
+	rb.ps = ps;
 
-	for (i = 0; i < len; i++) {
-		if (ref[i] != mem[i]) {
-			if (verbose)
-				printf("Diff @0x%04x (Is 0x%02x should be 0x%02x)\n", offset + i, mem[i], ref[i]);
-			ret = 1;
+	for (page = 0; page < pages; page += n) {
+		n = pages - page;
+		if (n > QUEUE_PAGES)
+			n = QUEUE_PAGES;
+
+		for (i = 0; i < n; i++) {
+			ret = Data_StreamRead(&s->stream, queue + ps * i, ps);
+			if (ret < 0) {
+				printf("\n");
+				fprintf(stderr, "Error reading file '%s'\n", s->file_write);
+				goto err;
+			}
+			has_data[i] = ret;
+			got[i] = 0;
+
+			// flash is erased, gaps (and blank pages with sparse
+			// write) are skipped
+			write[i] = ret && !(s->sparse && Data_IsBlank(queue + ps * i, ps));
+			if (!write[i])
+				skipped ++;
+		}
+		rb.page = page;
+
+		// runs of pages are written
+		for (first = 0; first < n; first = last) {
+			while ((first < n) && !write[first])
+				first ++;
+
+			last = first;
+			while ((last < n) && write[last])
+				last ++;
+
+			if (last == first)
+				continue;
+
+			if (s->cmd & CMD_VERIFY) {
+				ret = OLS_FlashWriteVerify(ols, page + first, last - first, queue + ps * first, readback_page, &rb);
+			} else {
+				ret = OLS_FlashWriteMulti(ols, page + first, last - first, queue + ps * first);
+			}
+
+			if (ret != last - first) {
+				// verify stopped at page of this run which differs
+				if (rb.stop && (rb.stop_page >= page + first) && (rb.stop_page < page + last)) {
+					stop = 1;
+					break;
+				}
+				printf("\n");
+				if (ret >= 0)
+					fprintf(stderr, "Write failed at page %d\n", page + first + ret);
+				goto err;
+			}
+		}
+
+		if (!(s->cmd & CMD_VERIFY))
+			continue;
+
+		// blank pages skipped by sparse write have to be erased
+		for (first = 0; !stop && (first < n); first = last) {
+			while ((first < n) && !(has_data[first] && !write[first]))
+				first ++;
+
+			last = first;
+			while ((last < n) && has_data[last] && !write[last])
+				last ++;
+
+			if (last == first)
+				continue;
+
+			ret = OLS_FlashReadMulti(ols, page + first, last - first, readback + ps * first);
+			if (ret != last - first) {
+				printf("\n");
+				goto err;
+			}
+			memset(got + first, 1, last - first);
+		}
+
+		// ranges of differences are built in address order
+		for (i = 0; i < n; i++) {
+			uint32_t addr = (page + i) * ps;
+			uint32_t len = ps;
+
+			if (!got[i])
+				continue;
+
+			// compare only up to end of file data
+			if (addr + len > max_addr) {
+				len = (addr < max_addr) ? max_addr - addr : 0;
+			}
+
+			if (Data_Compare(cmp, queue + ps * i, readback + ps * i, len, addr)) {
+				failed = 1;
+			}
+		}
+
+		if (stop || (failed && s->stop_early)) {
+			printf("\nStopped at first difference");
+			break;
 		}
 	}
+	printf("\n");
 
-	return ret;
+	if (skipped && (s->cmd & CMD_WRITE)) {
+		printf("Skipped %d blank pages\n", skipped);
+	}
+
+	free(queue);
+	return failed || rb.failed;
+
+err:
+	free(queue);
+	return -1;
 }
 
+struct verify_t {
+	struct session_t *s;
+	struct data_cmp_t *cmp;
+	uint8_t *ref;
+	uint16_t ps;
+	uint16_t gap;
+	int whole;
+	int pending;
+	int stopped;
+	int error;
+	int failed;
+};
+
+/*
+ * compares one page read back against next page of file
+ * returns non-zero to stop reading
+ */
+static int verify_page(void *ctx, uint32_t page, uint8_t *data)
+{
+	struct verify_t *v = ctx;
+	uint32_t max_addr = v->s->stream.max_addr;
+	uint32_t addr = page * v->ps;
+	uint32_t len = v->ps;
+	int ret = 1;
+
+	// first page of run was already taken from file while seeking
+	if (v->pending) {
+		v->pending = 0;
+	} else {
+		ret = Data_StreamRead(&v->s->stream, v->ref, v->ps);
+	}
+
+	if (ret < 0) {
+		v->error = 1;
+		v->stopped = 1;
+		return 1;
+	}
+
+	// flash has to hold what erase + write would leave there, gaps
+	// and tail of last page included
+	if (v->whole) {
+		if (memcmp(v->ref, data, v->ps)) {
+			v->failed = 1;
+			v->stopped = 1;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (ret == 0) {
+		// long gap is cheaper to seek over than to read
+		if (++v->gap >= VERIFY_GAP_PAGES) {
+			v->stopped = 1;
+			return 1;
+		}
+		return 0;
+	}
+	v->gap = 0;
+
+	// compare only up to end of file data
+	if (addr + len > max_addr) {
+		len = (addr < max_addr) ? max_addr - addr : 0;
+	}
+
+	if (Data_Compare(v->cmp, v->ref, data, len, addr)) {
+		v->failed = 1;
+		if (v->s->stop_early) {
+			v->stopped = 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * verifies flash against file, pages are compared as soon as they arrive
+ * while the read window stays full. Memory use is window + 1 pages.
+ * whole - compare every page completely and stop at first difference
+ * returns 0 if ok, 1 on verify error, -1 on failure
+ */
+static int verify_pages(struct session_t *s, struct ols_t *ols, uint32_t pages, struct data_cmp_t *cmp, int whole)
+{
+	struct verify_t v;
+	uint32_t ring_pages = ols->window;
+	uint8_t *ring;
+	uint32_t page = 0;
+	int ret;
+
+	memset(&v, 0, sizeof(v));
+	v.s = s;
+	v.cmp = cmp;
+	v.whole = whole;
+	v.ps = ols->flash->page_size;
+
+	ring = malloc((ring_pages + 1) * v.ps);
+	if (ring == NULL) {
+		fprintf(stderr, "Error allocating memory \n");
+		return -1;
+	}
+	v.ref = ring + ring_pages * v.ps;
+
+	while (page < pages) {
+		// seek to next page with data
+		while (!whole && (page < pages)) {
+			ret = Data_StreamRead(&s->stream, v.ref, v.ps);
+			if (ret < 0) {
+				v.error = 1;
+				break;
+			}
+			if (ret)
+				break;
+			page ++;
+		}
+
+		if (v.error || (page >= pages))
+			break;
+
+		v.pending = !whole;
+		v.gap = 0;
+		v.stopped = 0;
+
+		ret = OLS_FlashReadRing(ols, page, pages - page, ring, ring_pages, verify_page, &v);
+		if ((ret < 0) || (!v.stopped && (ret != pages - page))) {
+			printf("\n");
+			free(ring);
+			return -1;
+		}
+		page += ret;
+
+		if (v.error)
+			break;
+
+		if (v.failed && (whole || s->stop_early)) {
+			printf("\nStopped at first difference");
+			break;
+		}
+	}
+	printf("\n");
+
+	free(ring);
+
+	if (v.error) {
+		fprintf(stderr, "Error reading file '%s'\n", s->file_write);
+		return -1;
+	}
+
+	return v.failed;
+}
+
+static void print_rate(const char *what, uint32_t bytes, uint64_t start)
+{
+	uint64_t ms;
+
+	ms = serial_time_ms() - start;
+	if (ms == 0)
+		ms = 1;
+
+	printf("%s %u bytes in %u ms (%u kB/s)\n", what, bytes, (unsigned int)ms, (unsigned int)(bytes / ms));
+}
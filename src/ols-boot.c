@@ -25,8 +25,95 @@
 
 #include "boot_if.h"
 #include "ols-boot.h"
+#include "ols-usb.h"
+#include "serial.h"
 
-struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, int debug)
+#if !IS_WIN32
+/*
+ * opens bootloader device at given usb port path
+ */
+static libusb_device_handle *BOOT_OpenPath(libusb_context *ctx, uint16_t vid, uint16_t pid, const char *path)
+{
+	libusb_device **list;
+	libusb_device_handle *dev = NULL;
+	ssize_t cnt;
+	int i;
+
+	cnt = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		char p[OLS_USB_PATH_LEN];
+
+		if (libusb_get_device_descriptor(list[i], &desc) != 0)
+			continue;
+
+		if ((desc.idVendor != vid) || (desc.idProduct != pid))
+			continue;
+
+		OLS_USB_Path(list[i], p, sizeof(p));
+		if (strcmp(p, path) != 0)
+			continue;
+
+		if (libusb_open(list[i], &dev) != 0)
+			dev = NULL;
+		break;
+	}
+
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+
+	return dev;
+}
+#endif
+
+/*
+ * lists usb port paths of all bootloader devices
+ * paths - array of max entries, OLS_USB_PATH_LEN each
+ * returns number of devices found
+ */
+int BOOT_List(uint16_t vid, uint16_t pid, char (*paths)[OLS_USB_PATH_LEN], int max)
+{
+#if IS_WIN32
+	return 0;
+#else
+	libusb_context *ctx;
+	libusb_device **list;
+	ssize_t cnt;
+	int found = 0;
+	int i;
+
+	if (libusb_init(&ctx) != 0) {
+		return 0;
+	}
+
+	cnt = libusb_get_device_list(ctx, &list);
+	for (i = 0; (i < cnt) && (found < max); i++) {
+		struct libusb_device_descriptor desc;
+
+		if (libusb_get_device_descriptor(list[i], &desc) != 0)
+			continue;
+
+		if ((desc.idVendor != vid) || (desc.idProduct != pid))
+			continue;
+
+		OLS_USB_Path(list[i], paths[found], OLS_USB_PATH_LEN);
+		found ++;
+	}
+
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+
+	return found;
+#endif
+}
+
+/*
+ * opens bootloader device
+ * path - usb port path of device, NULL for first one found
+ * quiet - do not complain when device is not there (yet)
+ */
+static struct ols_boot_t *BOOT_Open(uint16_t vid, uint16_t pid, const char *path, int debug, int quiet)
 {
 #if IS_WIN32
 	GUID HidGuid;
@@ -50,6 +137,10 @@ struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, int debug)
 	memset(ob, 0, sizeof(struct ols_boot_t));
 
 #if IS_WIN32
+	if ((path != NULL) && !quiet) {
+		fprintf(stderr, "Selecting device by USB path is not supported, using first one\n");
+	}
+
 	HidD_GetHidGuid( &HidGuid);
 	hDevInfo = SetupDiGetClassDevs(&HidGuid, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
 	if (hDevInfo == INVALID_HANDLE_VALUE)
@@ -66,7 +157,10 @@ struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, int debug)
 		int bad = 0;
 
 		if (!SetupDiEnumDeviceInterfaces(hDevInfo, NULL, &HidGuid, DevIndex, &DevInterfaceData)) {
-			fprintf(stderr, "Device does not exist\n");
+			if (!quiet)
+				fprintf(stderr, "Device does not exist\n");
+			SetupDiDestroyDeviceInfoList(hDevInfo);
+			free(ob);
 			return NULL;
 		}
 
@@ -123,9 +217,16 @@ struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, int debug)
 		libusb_set_debug(ob->ctx, 4);
 	}
 
-	ob->dev = libusb_open_device_with_vid_pid(ob->ctx, vid, pid);
+	if (path == NULL) {
+		ob->dev = libusb_open_device_with_vid_pid(ob->ctx, vid, pid);
+	} else {
+		ob->dev = BOOT_OpenPath(ob->ctx, vid, pid, path);
+	}
+
 	if (ob->dev == NULL) {
-		fprintf(stderr, "USB Device (%04x:%04x) not found, is OLS in bootloader mode ?\n", vid, pid);
+		if (!quiet)
+			fprintf(stderr, "USB Device (%04x:%04x) not found, is OLS in bootloader mode ?\n", vid, pid);
+		libusb_exit(ob->ctx);
 		free(ob);
 		return NULL;
 	}
@@ -154,6 +255,100 @@ struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, int debug)
 	return ob;
 }
 
+struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, const char *path, int debug)
+{
+	return BOOT_Open(vid, pid, path, debug, 0);
+}
+
+#if !IS_WIN32
+static int LIBUSB_CALL BOOT_Arrived(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *data)
+{
+	*(int *)data = 1;
+
+	// keep callback registered
+	return 0;
+}
+#endif
+
+/*
+ * waits for bootloader device to show up, used after switch from APP
+ * mode. Device is opened as soon as it appears: on hotplug event where
+ * libusb has them, by polling otherwise.
+ * path - usb port path of device, NULL for first one found
+ * timeout - deadline in ms
+ */
+struct ols_boot_t *BOOT_Wait(uint16_t vid, uint16_t pid, const char *path, int debug, int timeout)
+{
+	struct ols_boot_t *ob;
+	uint64_t deadline;
+	uint64_t now;
+	uint32_t wait;
+#if !IS_WIN32
+	libusb_context *ctx = NULL;
+	libusb_hotplug_callback_handle cb;
+	struct timeval tv;
+	int hotplug = 0;
+	int arrived = 0;
+	int seen = 0;
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && (libusb_init(&ctx) == 0)) {
+		if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, vid, pid,
+			LIBUSB_HOTPLUG_MATCH_ANY, BOOT_Arrived, &arrived, &cb) == LIBUSB_SUCCESS) {
+			hotplug = 1;
+		}
+	}
+#endif
+
+	deadline = serial_time_ms() + timeout;
+
+	while (1) {
+		ob = BOOT_Open(vid, pid, path, debug, 1);
+		if (ob != NULL)
+			break;
+
+		now = serial_time_ms();
+		if (now >= deadline)
+			break;
+
+		wait = deadline - now;
+#if !IS_WIN32
+		// device which arrived may not be ready to open yet (permissions),
+		// or it is other device than the one we wait for
+		if (!hotplug || seen) {
+			if (wait > BOOT_POLL_MS)
+				wait = BOOT_POLL_MS;
+		}
+
+		if (hotplug) {
+			tv.tv_sec = wait / 1000;
+			tv.tv_usec = (wait % 1000) * 1000;
+			libusb_handle_events_timeout_completed(ctx, &tv, &arrived);
+			seen |= arrived;
+			arrived = 0;
+		} else {
+			serial_sleep_ms(wait);
+		}
+#else
+		if (wait > BOOT_POLL_MS)
+			wait = BOOT_POLL_MS;
+		serial_sleep_ms(wait);
+#endif
+	}
+
+#if !IS_WIN32
+	if (ctx != NULL) {
+		if (hotplug)
+			libusb_hotplug_deregister_callback(ctx, cb);
+		libusb_exit(ctx);
+	}
+#endif
+
+	if (ob == NULL)
+		fprintf(stderr, "USB Device (%04x:%04x) did not show up in %d ms\n", vid, pid, timeout);
+
+	return ob;
+}
+
 static uint8_t BOOT_Recv(struct ols_boot_t *ob, boot_rsp *rsp)
 {
 #if IS_WIN32
@@ -285,6 +480,245 @@ static uint8_t BOOT_SendRecv(struct ols_boot_t *ob, boot_cmd *cmd, boot_rsp *rsp
 	return 0;
 }
 
+#if !IS_WIN32
+struct boot_async_t;
+
+/* command in flight */
+struct boot_slot_t {
+	struct boot_async_t *a;
+	struct libusb_transfer *xfer;
+	uint8_t buf[LIBUSB_CONTROL_SETUP_SIZE + sizeof(boot_cmd)];
+	boot_cmd cmd;
+	int waiting;		// response not handled yet
+	int active;		// transfer not completed yet
+};
+
+/* response transfer, responses are not bound to any command until
+ * their echo is known */
+struct boot_in_t {
+	struct boot_async_t *a;
+	struct libusb_transfer *xfer;
+	boot_rsp rsp;
+	int active;
+};
+
+struct boot_async_t {
+	struct boot_slot_t slot[BOOT_QUEUE_DEPTH];
+	struct boot_in_t in[BOOT_QUEUE_DEPTH];
+	int waiting;
+	int active;
+	int error;
+	int stop;
+
+	int (*done)(void *, boot_cmd *, boot_rsp *);
+	void *ctx;
+};
+
+static void LIBUSB_CALL BOOT_AsyncSent(struct libusb_transfer *xfer)
+{
+	struct boot_slot_t *slot = xfer->user_data;
+	struct boot_async_t *a = slot->a;
+
+	slot->active = 0;
+	a->active --;
+
+	if (xfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
+	if ((xfer->status != LIBUSB_TRANSFER_COMPLETED) || (xfer->actual_length != sizeof(boot_cmd))) {
+		fprintf(stderr, "Error sending command (status %d)\n", xfer->status);
+		a->error = 1;
+	}
+}
+
+static void LIBUSB_CALL BOOT_AsyncRecv(struct libusb_transfer *xfer)
+{
+	struct boot_in_t *in = xfer->user_data;
+	struct boot_async_t *a = in->a;
+	int i;
+
+	in->active = 0;
+	a->active --;
+
+	// responses completed along with failed one are not trusted
+	if ((xfer->status == LIBUSB_TRANSFER_CANCELLED) || a->error || a->stop)
+		return;
+
+	if ((xfer->status != LIBUSB_TRANSFER_COMPLETED) || (xfer->actual_length != sizeof(boot_rsp))) {
+		fprintf(stderr, (xfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? "Com timeout\n" :
+			"Error receiving response (status %d)\n", xfer->status);
+		a->error = 1;
+		return;
+	}
+
+	for (i = 0; i < BOOT_QUEUE_DEPTH; i++) {
+		struct boot_slot_t *slot = &a->slot[i];
+
+		if (!slot->waiting || (slot->cmd.header.echo != in->rsp.header.echo))
+			continue;
+
+		slot->waiting = 0;
+		a->waiting --;
+
+		if (a->done(a->ctx, &slot->cmd, &in->rsp))
+			a->stop = 1;
+		return;
+	}
+
+	fprintf(stderr, "Id doesn't match. Bootloader error\n");
+	a->error = 1;
+}
+#endif
+
+/*
+ * runs stream of commands, keeps up to depth of them in flight. Responses
+ * are matched to commands by echo byte, so they may be handled out of order.
+ * depth - commands in flight, at most BOOT_QUEUE_DEPTH
+ * next - fills next command (echo is set here), returns 0 if there is none
+ * done - handles response of command, returns non-zero to stop
+ *
+ * returns 0 if all commands were done (or done stopped them), 1 on error
+ */
+static int BOOT_Pipeline(struct ols_boot_t *ob, int depth, int (*next)(void *, boot_cmd *),
+	int (*done)(void *, boot_cmd *, boot_rsp *), void *ctx)
+{
+#if IS_WIN32
+	// one by one, HID reports are not queued here
+	boot_cmd cmd;
+	boot_rsp rsp;
+
+	while (1) {
+		memset(&cmd, 0, sizeof(cmd));
+		if (!next(ctx, &cmd))
+			break;
+
+		cmd.header.echo = ob->cmd_id ++;
+		if (BOOT_SendRecv(ob, &cmd, &rsp))
+			return 1;
+
+		if (done(ctx, &cmd, &rsp))
+			break;
+	}
+
+	return 0;
+#else
+	struct boot_async_t a;
+	struct timeval tv;
+	int more = 1;
+	int recv = 0;
+	int i;
+
+	if (depth > BOOT_QUEUE_DEPTH)
+		depth = BOOT_QUEUE_DEPTH;
+	if (depth < 1)
+		depth = 1;
+
+	memset(&a, 0, sizeof(a));
+	a.done = done;
+	a.ctx = ctx;
+
+	for (i = 0; i < depth; i++) {
+		a.slot[i].a = &a;
+		a.slot[i].xfer = libusb_alloc_transfer(0);
+		a.in[i].a = &a;
+		a.in[i].xfer = libusb_alloc_transfer(0);
+		if ((a.slot[i].xfer == NULL) || (a.in[i].xfer == NULL)) {
+			fprintf(stderr, "Not enough memory \n");
+			a.error = 1;
+			depth = i + 1;
+			break;
+		}
+	}
+
+	while (!a.error && !a.stop) {
+		// refill free slots, slot is free once both its command went
+		// out and its response came back
+		for (i = 0; more && !a.error && (i < depth); i++) {
+			struct boot_slot_t *slot = &a.slot[i];
+
+			if (slot->waiting || slot->active)
+				continue;
+
+			memset(&slot->cmd, 0, sizeof(slot->cmd));
+			more = next(ctx, &slot->cmd);
+			if (!more)
+				break;
+			slot->cmd.header.echo = ob->cmd_id ++;
+
+			libusb_fill_control_setup(slot->buf, 0x21, 0x09, 0x0000, 0x0000, sizeof(boot_cmd));
+			memcpy(slot->buf + LIBUSB_CONTROL_SETUP_SIZE, &slot->cmd, sizeof(boot_cmd));
+			libusb_fill_control_transfer(slot->xfer, ob->dev, slot->buf, BOOT_AsyncSent, slot, OLS_TIMEOUT);
+
+			if (libusb_submit_transfer(slot->xfer) != 0) {
+				fprintf(stderr, "Error sending command\n");
+				a.error = 1;
+				break;
+			}
+			slot->active = 1;
+			slot->waiting = 1;
+			a.active ++;
+			a.waiting ++;
+		}
+
+		// one response transfer for every command waiting for it
+		recv = 0;
+		for (i = 0; i < depth; i++)
+			recv += a.in[i].active;
+
+		for (i = 0; !a.error && (recv < a.waiting) && (i < depth); i++) {
+			struct boot_in_t *in = &a.in[i];
+
+			if (in->active)
+				continue;
+
+			libusb_fill_interrupt_transfer(in->xfer, ob->dev, 0x81, (uint8_t *)&in->rsp, sizeof(boot_rsp),
+				BOOT_AsyncRecv, in, OLS_TIMEOUT);
+			if (libusb_submit_transfer(in->xfer) != 0) {
+				fprintf(stderr, "Error receiving response\n");
+				a.error = 1;
+				break;
+			}
+			in->active = 1;
+			a.active ++;
+			recv ++;
+		}
+
+		if (!more && (a.waiting == 0))
+			break;
+
+		if (a.error)
+			break;
+
+		// every transfer has its own timeout
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		libusb_handle_events_timeout_completed(ob->ctx, &tv, NULL);
+	}
+
+	// stopped early, nothing may be left referring to this frame
+	for (i = 0; i < depth; i++) {
+		if (a.slot[i].active)
+			libusb_cancel_transfer(a.slot[i].xfer);
+		if (a.in[i].active)
+			libusb_cancel_transfer(a.in[i].xfer);
+	}
+
+	while (a.active > 0) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (libusb_handle_events_timeout_completed(ob->ctx, &tv, NULL) < 0)
+			break;
+	}
+
+	for (i = 0; i < depth; i++) {
+		libusb_free_transfer(a.slot[i].xfer);
+		libusb_free_transfer(a.in[i].xfer);
+	}
+
+	return a.error;
+#endif
+}
+
 uint8_t BOOT_Version(struct ols_boot_t *ob)
 {
 	boot_cmd cmd;
@@ -307,123 +741,182 @@ uint8_t BOOT_Version(struct ols_boot_t *ob)
 	return 0;
 }
 
-uint8_t BOOT_Read(struct ols_boot_t *ob, uint16_t addr, uint8_t *buf, uint16_t size)
+struct boot_read_t {
+	uint8_t *buf;
+	uint16_t addr;		// address of buf[0]
+	uint16_t next;		// next address to ask for
+	uint16_t end;
+};
+
+static uint16_t BOOT_ReadLen(struct boot_read_t *r, uint16_t address)
 {
-	// todo loop
-	boot_cmd cmd;
-	boot_rsp rsp;
-	uint16_t address = 0;
+	return (r->end - address > OLS_READ_SIZE) ? OLS_READ_SIZE : r->end - address;
+}
+
+static int BOOT_ReadNext(void *ctx, boot_cmd *cmd)
+{
+	struct boot_read_t *r = ctx;
 	uint16_t len;
-	int ret;
 
-	memset(&cmd, 0, sizeof(cmd));
+	if (r->next >= r->end)
+		return 0;
 
-	while (size > 0) {
-		len = (size > OLS_READ_SIZE) ? OLS_READ_SIZE : size;
-		cmd.header.cmd = BOOT_READ_FLASH;
-		cmd.header.echo = ob->cmd_id ++;
+	len = BOOT_ReadLen(r, r->next);
 
-		cmd.read_flash.addr_hi = (address >> 8) & 0xff;
-		cmd.read_flash.addr_lo = address & 0xff;
-		cmd.read_flash.size8 = (len%2)?len+1:len; // round if odd
+	cmd->header.cmd = BOOT_READ_FLASH;
+	cmd->read_flash.addr_hi = (r->next >> 8) & 0xff;
+	cmd->read_flash.addr_lo = r->next & 0xff;
+	cmd->read_flash.size8 = (len%2)?len+1:len; // round if odd
 
-		ret = BOOT_SendRecv(ob, &cmd, &rsp);
-		if (ret != 0) {
-			fprintf(stderr, "Error reading memory\n");
-			return 1;
-		}
-		memcpy(buf, rsp.read_flash.data, len);
-		buf += len;
-		size -= len;
-		address += len;
+	r->next += len;
+	return 1;
+}
+
+static int BOOT_ReadDone(void *ctx, boot_cmd *cmd, boot_rsp *rsp)
+{
+	struct boot_read_t *r = ctx;
+	uint16_t address;
+
+	// chunk goes where its command asked for, whatever order they come in
+	address = (cmd->read_flash.addr_hi << 8) | cmd->read_flash.addr_lo;
+	memcpy(r->buf + (address - r->addr), rsp->read_flash.data, BOOT_ReadLen(r, address));
+
+	return 0;
+}
+
+uint8_t BOOT_Read(struct ols_boot_t *ob, uint16_t addr, uint8_t *buf, uint16_t size)
+{
+	struct boot_read_t r;
+
+	r.buf = buf;
+	r.addr = addr;
+	r.next = addr;
+	r.end = addr + size;
+
+	if (BOOT_Pipeline(ob, BOOT_QUEUE_DEPTH, BOOT_ReadNext, BOOT_ReadDone, &r)) {
+		fprintf(stderr, "Error reading memory\n");
+		return 1;
 	}
 	return 0;
 }
 
-uint8_t BOOT_Write(struct ols_boot_t *ob, uint16_t addr, uint8_t *buf, uint16_t size_in)
+struct boot_write_t {
+	uint8_t *buf;
+	uint16_t addr;		// address of buf[0]
+	uint16_t next;		// next address to write
+	uint16_t end;
+	int flush;
+	uint32_t acked;		// bytes confirmed by device
+};
+
+static int BOOT_WriteNext(void *ctx, boot_cmd *cmd)
 {
-	// todo loop
-	boot_cmd cmd;
-	boot_rsp rsp;
-	uint16_t address = 0;
+	struct boot_write_t *w = ctx;
+	uint8_t *buf;
 	uint16_t len;
-	int32_t size = size_in;
-	int flush = 1;
-	int ret;
 
-	address = addr;
+	if (w->next >= w->end)
+		return 0;
 
-	while (size > 0) {
-		memset(&cmd, 0, sizeof(cmd));
+	buf = w->buf + (w->next - w->addr);
 #if OLS_PAGE_SIZE == 2
-		len = (size > OLS_PAGE_SIZE) ? OLS_PAGE_SIZE : size;
-		len = (len % 2) ? len + 1: len; // round odd
+	len = (w->end - w->next > OLS_PAGE_SIZE) ? OLS_PAGE_SIZE : w->end - w->next;
 
-		memcpy(cmd.write_flash.data, buf, len);
+	memcpy(cmd->write_flash.data, buf, len);
+	len = (len % 2) ? len + 1: len; // round odd
 
-		// command bootloader to only write 2 bytes
-		cmd.write_flash.flush = OLS_WRITE_2BYTE | OLS_WRITE_FLUSH;
+	// command bootloader to only write 2 bytes
+	cmd->write_flash.flush = OLS_WRITE_2BYTE | OLS_WRITE_FLUSH;
 #elif OLS_PAGE_SIZE == 64
-		flush ^= 1; // toggle flush
+	w->flush ^= 1; // toggle flush
 
-		len = (size > (OLS_PAGE_SIZE/2)) ? OLS_PAGE_SIZE/2 : size;
+	len = (w->end - w->next > (OLS_PAGE_SIZE/2)) ? OLS_PAGE_SIZE/2 : w->end - w->next;
 
-		memset(cmd.write_flash.data, 0xff, sizeof(cmd.write_flash.data));
-		memcpy(cmd.write_flash.data, buf, len);
+	memset(cmd->write_flash.data, 0xff, sizeof(cmd->write_flash.data));
+	memcpy(cmd->write_flash.data, buf, len);
 
-		// in this mode we always write 32 bytes
-		// rest is padded with 0xff
-		len = OLS_PAGE_SIZE/2;
+	// in this mode we always write 32 bytes
+	// rest is padded with 0xff
+	len = OLS_PAGE_SIZE/2;
 
-		// command bootloader to write 64bytes
-		cmd.write_flash.flush = flush & OLS_WRITE_FLUSH;
+	// command bootloader to write 64bytes
+	cmd->write_flash.flush = w->flush & OLS_WRITE_FLUSH;
 #else
 #error "Unsupported page size"
 #endif
 
-		cmd.header.cmd = BOOT_WRITE_FLASH;
-		cmd.header.echo = ob->cmd_id ++;
+	if ((w->next < OLS_FLASH_ADDR) || (w->next + len > OLS_FLASH_ADDR + OLS_FLASH_SIZE)) {
+		fprintf(stderr, "Protecting bootloader - skip @0x%04x\n", w->next);
+		// we end
+		return 0;
+	}
 
-		cmd.write_flash.addr_hi = (address >> 8) & 0xff;
-		cmd.write_flash.addr_lo = address & 0xff;
-		cmd.write_flash.size8 = len;
+	cmd->header.cmd = BOOT_WRITE_FLASH;
+	cmd->write_flash.addr_hi = (w->next >> 8) & 0xff;
+	cmd->write_flash.addr_lo = w->next & 0xff;
+	cmd->write_flash.size8 = len;
 
-		if (address < OLS_FLASH_ADDR) {
-			fprintf(stderr, "Protecting bootloader - skip @0x%04x\n", address);
-		} if (address + len > OLS_FLASH_ADDR + OLS_FLASH_SIZE) {
-			fprintf(stderr, "Protecting bootloader - skip @0x%04x\n", address);
-			// we end
-			break;
-		} else {
-			ret = BOOT_SendRecv(ob, &cmd, &rsp);
-		}
-		if (ret != 0) {
-			fprintf(stderr, "Error writing memory\n");
-			return 1;
-		}
+	w->next += len;
+	return 1;
+}
+
+static int BOOT_WriteDone(void *ctx, boot_cmd *cmd, boot_rsp *rsp)
+{
+	struct boot_write_t *w = ctx;
 
-		buf += len;
-		size -= len;
-		address += len;
+	w->acked += cmd->write_flash.size8;
+	return 0;
+}
+
+/*
+ * writes application, halves of 64 byte row go in pairs, second one
+ * flushes the row. Up to BOOT_WRITE_ROWS rows are in flight, first
+ * failed response stops the write.
+ * addr - start of row, application area only
+ */
+uint8_t BOOT_Write(struct ols_boot_t *ob, uint16_t addr, uint8_t *buf, uint16_t size)
+{
+	struct boot_write_t w;
+
+	w.buf = buf;
+	w.addr = addr;
+	w.next = addr;
+	w.end = addr + size;
+	w.flush = 1;
+	w.acked = 0;
+
+	if (BOOT_Pipeline(ob, 2 * BOOT_WRITE_ROWS, BOOT_WriteNext, BOOT_WriteDone, &w)) {
+		fprintf(stderr, "Error writing memory (%u bytes from 0x%04x confirmed)\n", w.acked, addr);
+		return 1;
 	}
 	return 0;
 }
 
-uint8_t BOOT_Erase(struct ols_boot_t *ob)
+/*
+ * erases blocks of application area
+ * addr - address of first block, multiple of OLS_ERASE_SIZE
+ * blocks - number of OLS_ERASE_SIZE blocks
+ */
+uint8_t BOOT_EraseRange(struct ols_boot_t *ob, uint16_t addr, uint8_t blocks)
 {
 	boot_cmd cmd;
 	boot_rsp rsp;
-	uint16_t address = 0;
 	int ret;
 
+	if ((addr % OLS_ERASE_SIZE) || (addr < OLS_FLASH_ADDR) ||
+	    (addr + blocks * OLS_ERASE_SIZE > OLS_FLASH_ADDR + OLS_FLASH_SIZE)) {
+		fprintf(stderr, "Protecting bootloader - not erasing @0x%04x\n", addr);
+		return 1;
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 
 	cmd.header.cmd = BOOT_ERASE_FLASH;
 	cmd.header.echo = ob->cmd_id ++;
 
-	cmd.erase_flash.addr_hi = 0x08;//(address >> 8) & 0xff;
-	cmd.erase_flash.addr_lo = 0x00;//address & 0xff;
-	cmd.erase_flash.size_x64 = 0x0d;//64;
+	cmd.erase_flash.addr_hi = (addr >> 8) & 0xff;
+	cmd.erase_flash.addr_lo = addr & 0xff;
+	cmd.erase_flash.size_x64 = blocks;
 
 	ret = BOOT_SendRecv(ob, &cmd, &rsp);
 	if (ret != 0) {
@@ -432,6 +925,104 @@ uint8_t BOOT_Erase(struct ols_boot_t *ob)
 	return ret;
 }
 
+uint8_t BOOT_Erase(struct ols_boot_t *ob)
+{
+	return BOOT_EraseRange(ob, OLS_FLASH_ADDR, OLS_FLASH_SIZE / OLS_ERASE_SIZE);
+}
+
+static int BOOT_Blank(uint8_t *buf, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] != 0xff)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * updates application area to image, touching only what differs. Erase
+ * block is erased if some row of it changes and that row is not blank
+ * yet, rows which are blank in image are not written after erase.
+ * image - whole flash image (OLS_FLASH_TOTSIZE), 0xff where there is no data
+ */
+uint8_t BOOT_Update(struct ols_boot_t *ob, uint8_t *image)
+{
+	uint8_t *cur;
+	uint8_t *new;
+	uint8_t erase[OLS_FLASH_SIZE / OLS_ERASE_SIZE];
+	uint8_t write[OLS_FLASH_SIZE / OLS_PAGE_SIZE];
+	int blocks = OLS_FLASH_SIZE / OLS_ERASE_SIZE;
+	int rows = OLS_FLASH_SIZE / OLS_PAGE_SIZE;
+	int per_block = OLS_ERASE_SIZE / OLS_PAGE_SIZE;
+	int erased = 0;
+	int written = 0;
+	int b, r, n;
+
+	cur = malloc(OLS_FLASH_SIZE);
+	if (cur == NULL) {
+		fprintf(stderr, "Not enough memory \n");
+		return 1;
+	}
+
+	if (BOOT_Read(ob, OLS_FLASH_ADDR, cur, OLS_FLASH_SIZE)) {
+		free(cur);
+		return 1;
+	}
+	new = image + OLS_FLASH_ADDR;
+
+	memset(erase, 0, sizeof(erase));
+	memset(write, 0, sizeof(write));
+
+	for (r = 0; r < rows; r++) {
+		int o = r * OLS_PAGE_SIZE;
+
+		if (memcmp(cur + o, new + o, OLS_PAGE_SIZE) == 0)
+			continue;
+
+		// only blank row may be programmed without erase
+		if (!BOOT_Blank(cur + o, OLS_PAGE_SIZE))
+			erase[r / per_block] = 1;
+		write[r] = 1;
+	}
+
+	// erase brings back blank rows of block, those which are not blank
+	// in image have to be written again
+	for (b = 0; b < blocks; b++) {
+		if (!erase[b])
+			continue;
+
+		for (r = b * per_block; r < (b + 1) * per_block; r++)
+			write[r] = !BOOT_Blank(new + r * OLS_PAGE_SIZE, OLS_PAGE_SIZE);
+	}
+	free(cur);
+
+	// neighbouring blocks go in single erase, rows in single write
+	for (b = 0; b < blocks; b += n) {
+		for (n = 1; erase[b] && (b + n < blocks) && erase[b + n]; n++);
+		if (!erase[b])
+			continue;
+
+		if (BOOT_EraseRange(ob, OLS_FLASH_ADDR + b * OLS_ERASE_SIZE, n))
+			return 1;
+		erased += n;
+	}
+
+	for (r = 0; r < rows; r += n) {
+		for (n = 1; write[r] && (r + n < rows) && write[r + n]; n++);
+		if (!write[r])
+			continue;
+
+		if (BOOT_Write(ob, OLS_FLASH_ADDR + r * OLS_PAGE_SIZE, new + r * OLS_PAGE_SIZE, n * OLS_PAGE_SIZE))
+			return 1;
+		written += n;
+	}
+
+	printf("Erased %d of %d blocks, wrote %d of %d rows\n", erased, blocks, written, rows);
+	return 0;
+}
+
 uint8_t BOOT_Reset(struct ols_boot_t *ob)
 {
 	boot_cmd cmd;
@@ -31,18 +31,33 @@
 #include <libusb.h>
 #endif
 
+#include "ols-usb.h"
+
 #define OLS_VID         0x04d8
 #define OLS_PID         0xfc90
 
 #define OLS_TIMEOUT     1000
+
+// bootloader device has to show up within this after switch from APP mode
+#define BOOT_TIMEOUT_SWITCH 10000
+// device list is checked this often while waiting for it
+#define BOOT_POLL_MS    50
+
+// commands kept in flight, echo byte tells their responses apart
+#define BOOT_QUEUE_DEPTH 8
+// rows written at once, each takes pair of commands
+#define BOOT_WRITE_ROWS (BOOT_QUEUE_DEPTH / 2)
 #define OLS_PAGE_SIZE   64
-#define OLS_READ_SIZE   (sizeof(rsp.read_flash.data))
+#define OLS_READ_SIZE   (sizeof(((boot_rsp *)0)->read_flash.data))
 
 #define OLS_FLASH_SIZE  0x3400 // 16*0x400 - 3*0x400
 #define OLS_FLASH_ADDR  0x0800 // protect bootloader
 
 #define OLS_FLASH_TOTSIZE 0x4000
 
+// erase block of PIC flash, size_x64 of erase command counts these
+#define OLS_ERASE_SIZE  0x0400
+
 enum {
 	OLS_WRITE_FLUSH = 1,
 	OLS_WRITE_2BYTE = 2,
@@ -60,11 +75,15 @@ struct ols_boot_t {
 	uint8_t cmd_id;
 };
 
-struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, int debug);
+struct ols_boot_t *BOOT_Init(uint16_t vid, uint16_t pid, const char *path, int debug);
+struct ols_boot_t *BOOT_Wait(uint16_t vid, uint16_t pid, const char *path, int debug, int timeout);
+int BOOT_List(uint16_t vid, uint16_t pid, char (*paths)[OLS_USB_PATH_LEN], int max);
 uint8_t BOOT_Version(struct ols_boot_t *ob);
 uint8_t BOOT_Read(struct ols_boot_t *ob, uint16_t addr, uint8_t *buf, uint16_t size);
 uint8_t BOOT_Write(struct ols_boot_t *ob, uint16_t addr, uint8_t *buf, uint16_t size);
 uint8_t BOOT_Erase(struct ols_boot_t *ob);
+uint8_t BOOT_EraseRange(struct ols_boot_t *ob, uint16_t addr, uint8_t blocks);
+uint8_t BOOT_Update(struct ols_boot_t *ob, uint8_t *image);
 uint8_t BOOT_Reset(struct ols_boot_t *ob);
 void BOOT_Deinit(struct ols_boot_t *ob);
 #endif
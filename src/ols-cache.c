@@ -0,0 +1,285 @@
+/*
+ * Part of ols-fwloader - cache of device profiles between sessions
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Profile of every port (device id, flash JEDEC id, measured latencies and
+ * erase time) is kept in $XDG_CACHE_HOME/ols-fwloader/<port>, so page reply
+ * timeouts of next session are tight from the first page. Serial ports are
+ * named by usb port path of device behind them where it is known, ttyACM
+ * numbers change when devices re-enumerate. Cached profile is only used
+ * when device answers with the same ids again.
+ *
+ *   id 2 3 0 2
+ *   jedec ef401400
+ *   read 310 420
+ *   write 650 900
+ *   erase 1850
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if IS_WIN32
+#include <direct.h>
+#include <process.h>
+#define mkdir(d, m) _mkdir(d)
+#define OLS_CACHE_ENV "LOCALAPPDATA"
+#define OLS_CACHE_DIR "ols-fwloader"
+#else
+#include <unistd.h>
+#define OLS_CACHE_ENV "XDG_CACHE_HOME"
+#define OLS_CACHE_DIR ".cache/ols-fwloader"
+#endif
+
+#include "ols-cache.h"
+#include "ols-usb.h"
+#include "farm.h"
+
+static int cache_enabled = 1;
+
+/*
+ * turns profile cache on or off
+ */
+void OLS_CacheEnable(int enable)
+{
+	cache_enabled = enable;
+}
+
+/*
+ * creates directory with its parents
+ */
+static int OLS_CacheMkdir(char *dir)
+{
+	char *c;
+	char sep;
+
+	// parents which cannot be made (drive, no access) show up below
+	for (c = dir + 1; *c; c++) {
+		if ((*c != '/') && (*c != '\\'))
+			continue;
+
+		sep = *c;
+		*c = 0;
+		mkdir(dir, 0755);
+		*c = sep;
+	}
+
+	if ((mkdir(dir, 0755) != 0) && (errno != EEXIST))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * returns allocated name of cache file of port, NULL if cache is off or
+ * there is no place for it
+ * port - serial port or usb[:path|serial]
+ */
+char *OLS_CacheFile(const char *port)
+{
+	const char *base;
+	const char *sub = OLS_CACHE_DIR;
+	char path[64];
+	char key[80];
+	char *file;
+	char *c;
+	int len;
+
+	if (!cache_enabled)
+		return NULL;
+
+	base = getenv(OLS_CACHE_ENV);
+#if !IS_WIN32
+	if ((base != NULL) && (*base != 0)) {
+		// XDG dir is the cache dir itself
+		sub = "ols-fwloader";
+	} else {
+		base = getenv("HOME");
+	}
+#endif
+	if ((base == NULL) || (*base == 0))
+		return NULL;
+
+	// same device keeps its usb port path, unlike its tty name
+	if ((strncasecmp(port, OLS_USB_PREFIX, strlen(OLS_USB_PREFIX)) != 0) &&
+	    (Farm_UsbPath(port, path, sizeof(path)) == 0)) {
+		snprintf(key, sizeof(key), "serial@%s", path);
+		port = key;
+	}
+
+	len = strlen(base) + strlen(sub) + strlen(port) + 3;
+	file = malloc(len);
+	if (file == NULL)
+		return NULL;
+
+	snprintf(file, len, "%s/%s", base, sub);
+	if (OLS_CacheMkdir(file)) {
+		free(file);
+		return NULL;
+	}
+
+	// port name is flattened into single file name
+	c = file + strlen(file);
+	*c++ = '/';
+	for (; *port; port++)
+		*c++ = isalnum((unsigned char)*port) ? *port : '_';
+	*c = 0;
+
+	return file;
+}
+
+/*
+ * fakes latency samples, so timeouts are sized by cached percentiles
+ * until new samples take over
+ */
+static void OLS_CacheSeed(struct ols_lat_t *lat, uint32_t p50_us, uint32_t p99_us)
+{
+	int i;
+
+	if (p99_us == 0)
+		return;
+
+	for (i = 0; i < OLS_LAT_MIN - 1; i++)
+		lat->us[i] = p50_us;
+	lat->us[i] = p99_us;
+
+	lat->count = OLS_LAT_MIN;
+	lat->p50_us = p50_us;
+	lat->p99_us = p99_us;
+}
+
+/*
+ * loads cached profile
+ * file - cache file
+ * p - profile to fill
+ *
+ * returns 0 if ok, -1 if there is no valid profile
+ */
+int OLS_CacheLoad(const char *file, struct ols_profile_t *p)
+{
+	unsigned int a, b, c, d;
+	char line[128];
+	int have_id = 0;
+	FILE *f;
+
+	memset(p, 0, sizeof(struct ols_profile_t));
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "id %u %u %u %u", &a, &b, &c, &d) == 4) {
+			p->id[0] = a;
+			p->id[1] = b;
+			p->id[2] = c;
+			p->id[3] = d;
+			have_id = 1;
+		} else if (sscanf(line, "jedec %x", &a) == 1) {
+			p->jedec = a;
+		} else if (sscanf(line, "read %u %u", &a, &b) == 2) {
+			OLS_CacheSeed(&p->read, a, b);
+		} else if (sscanf(line, "write %u %u", &a, &b) == 2) {
+			OLS_CacheSeed(&p->write, a, b);
+		} else if (sscanf(line, "erase %u", &a) == 1) {
+			p->erase_ms = a;
+		}
+	}
+	fclose(f);
+
+	if (!have_id || (p->jedec == 0)) {
+		memset(p, 0, sizeof(struct ols_profile_t));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * stores profile, file is replaced at once so parallel sessions never
+ * see half written profile
+ * file - cache file
+ * p - profile to store
+ *
+ * returns 0 if ok, -1 on error
+ */
+int OLS_CacheSave(const char *file, struct ols_profile_t *p)
+{
+	char *tmp;
+	FILE *f;
+	int len;
+	int ret = 0;
+
+	len = strlen(file) + 24;
+	tmp = malloc(len);
+	if (tmp == NULL)
+		return -1;
+
+	// temp file of its own, parallel sessions (farm) save at once
+#if IS_WIN32
+	snprintf(tmp, len, "%s.%d.tmp", file, _getpid());
+	f = fopen(tmp, "w");
+#else
+	{
+		int fd;
+
+		snprintf(tmp, len, "%s.XXXXXX", file);
+		fd = mkstemp(tmp);
+		f = (fd < 0) ? NULL : fdopen(fd, "w");
+		if ((f == NULL) && (fd >= 0)) {
+			close(fd);
+			remove(tmp);
+		}
+	}
+#endif
+	if (f == NULL) {
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(f, "id %u %u %u %u\n", p->id[0], p->id[1], p->id[2], p->id[3]);
+	fprintf(f, "jedec %08x\n", p->jedec);
+	if (p->read.count >= OLS_LAT_MIN)
+		fprintf(f, "read %u %u\n", p->read.p50_us, p->read.p99_us);
+	if (p->write.count >= OLS_LAT_MIN)
+		fprintf(f, "write %u %u\n", p->write.p50_us, p->write.p99_us);
+	if (p->erase_ms)
+		fprintf(f, "erase %u\n", p->erase_ms);
+
+	if (fclose(f) != 0)
+		ret = -1;
+
+#if IS_WIN32
+	// rename does not replace existing file here
+	remove(file);
+#endif
+	if ((ret == 0) && (rename(tmp, file) != 0))
+		ret = -1;
+
+	if (ret)
+		remove(tmp);
+
+	free(tmp);
+	return ret;
+}
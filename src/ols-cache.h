@@ -0,0 +1,32 @@
+/*
+ * Part of ols-fwloader - cache of device profiles between sessions
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OLS_CACHE_H_
+#define OLS_CACHE_H_
+
+#include <stdint.h>
+
+#include "ols.h"
+
+void OLS_CacheEnable(int enable);
+char *OLS_CacheFile(const char *port);
+int OLS_CacheLoad(const char *file, struct ols_profile_t *p);
+int OLS_CacheSave(const char *file, struct ols_profile_t *p);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Part of ols-fwloader - database of supported SPI flash parts
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Parts are kept sorted by JEDEC id and looked up with bsearch. Built-in
+ * table can be extended (or overridden) by table file, one part per line:
+ *
+ *   # jedec  page  pages  shift  program_us  erase_ms  name
+ *   ef401400 256   4096   8      700         2000      WINBOND W25Q80
+ *
+ * shift - page number is shifted by this to get flash address
+ * program_us, erase_ms - typical page program and chip erase time
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ols-parts.h"
+
+// sorted by JEDEC id
+static const struct ols_flash_t OLS_PartBuiltin[] = {
+	{ 0x1f230000, 264, 1024, 9, 14000, 4000, "ATMEL AT45DB021D" },
+	{ 0x1f240000, 264, 2048, 9, 14000, 7000, "ATMEL AT45DB041D" },
+	{ 0xef301200, 256, 1024, 8, 1500, 2000, "WINBOND W25X20" },
+	{ 0xef301300, 256, 2048, 8, 1500, 4000, "WINBOND W25X40" },
+	{ 0xef301400, 256, 4096, 8, 1500, 6000, "WINBOND W25X80" },
+	{ 0xef401400, 256, 4096, 8, 700, 2000, "WINBOND W25Q80" },
+	{ 0xef401500, 256, 8192, 8, 700, 3000, "WINBOND W25Q16" },
+	{ 0xef401600, 256, 16384, 8, 700, 10000, "WINBOND W25Q32" },
+	{ 0xef401700, 256, 32768, 8, 700, 20000, "WINBOND W25Q64" },
+	{ 0xef401800, 256, 65536, 8, 700, 40000, "WINBOND W25Q128" },
+};
+
+#define OLS_PART_BUILTIN_NUM (sizeof(OLS_PartBuiltin)/sizeof(struct ols_flash_t))
+
+static const struct ols_flash_t *parts = OLS_PartBuiltin;
+static int parts_num = OLS_PART_BUILTIN_NUM;
+
+static int OLS_PartCmp(const void *a, const void *b)
+{
+	uint32_t ja = ((const struct ols_flash_t *)a)->jedec;
+	uint32_t jb = ((const struct ols_flash_t *)b)->jedec;
+
+	return (ja > jb) - (ja < jb);
+}
+
+/*
+ * adds parts from table file, parts already known are replaced
+ * file - table file
+ *
+ * returns 0 if ok, -1 on error
+ */
+int OLS_PartLoad(const char *file)
+{
+	struct ols_flash_t *tab;
+	struct ols_flash_t p;
+	struct ols_flash_t *found;
+	unsigned int page_size, pages, shift;
+	unsigned int program_us, erase_ms;
+	unsigned int jedec;
+	char line[256];
+	int alloc = parts_num + 16;
+	int num = parts_num;
+	int lineno = 0;
+	int added = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to open flash part table '%s'\n", file);
+		return -1;
+	}
+
+	tab = malloc(alloc * sizeof(struct ols_flash_t));
+	if (tab == NULL) {
+		fprintf(stderr, "Error allocating memory \n");
+		fclose(f);
+		return -1;
+	}
+	memcpy(tab, parts, parts_num * sizeof(struct ols_flash_t));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *c;
+
+		lineno ++;
+
+		c = line + strspn(line, " \t\r\n");
+		if ((*c == 0) || (*c == '#'))
+			continue;
+
+		memset(&p, 0, sizeof(p));
+		if (sscanf(c, "%x %u %u %u %u %u %31[^\r\n]", &jedec, &page_size, &pages, &shift,
+			&program_us, &erase_ms, p.name) != 7) {
+			fprintf(stderr, "%s:%d: malformed part\n", file, lineno);
+			goto err;
+		}
+
+		// page has to fit its address slot, address is 24 bits
+		if ((page_size == 0) || (page_size > OLS_PAGE_SIZE_MAX) || (pages == 0) ||
+		    (shift > 23) || ((1UL << shift) < page_size) || (((unsigned long)pages << shift) > 0x1000000UL)) {
+			fprintf(stderr, "%s:%d: unsupported geometry of '%s'\n", file, lineno, p.name);
+			goto err;
+		}
+
+		p.jedec = jedec;
+		p.page_size = page_size;
+		p.pages = pages;
+		p.addr_shift = shift;
+		p.program_us = program_us;
+		p.erase_ms = erase_ms;
+
+		// table is still sorted up to num, only new parts are appended
+		found = bsearch(&p, tab, parts_num, sizeof(struct ols_flash_t), OLS_PartCmp);
+		if (found == NULL) {
+			int i;
+
+			for (i = parts_num; i < num; i++) {
+				if (tab[i].jedec == p.jedec) {
+					found = &tab[i];
+					break;
+				}
+			}
+		}
+
+		if (found != NULL) {
+			*found = p;
+		} else {
+			if (num == alloc) {
+				struct ols_flash_t *t;
+
+				alloc *= 2;
+				t = realloc(tab, alloc * sizeof(struct ols_flash_t));
+				if (t == NULL) {
+					fprintf(stderr, "Error allocating memory \n");
+					goto err;
+				}
+				tab = t;
+			}
+			tab[num++] = p;
+		}
+		added ++;
+	}
+	fclose(f);
+
+	qsort(tab, num, sizeof(struct ols_flash_t), OLS_PartCmp);
+
+	if (parts != OLS_PartBuiltin)
+		free((void *)parts);
+	parts = tab;
+	parts_num = num;
+
+	printf("Loaded %d flash parts from '%s'\n", added, file);
+	return 0;
+
+err:
+	fclose(f);
+	free(tab);
+	return -1;
+}
+
+/*
+ * finds part by JEDEC id (first id byte in MSB)
+ * returns NULL if part is not known
+ */
+const struct ols_flash_t *OLS_PartFind(uint32_t jedec)
+{
+	struct ols_flash_t key;
+
+	key.jedec = jedec;
+	return bsearch(&key, parts, parts_num, sizeof(struct ols_flash_t), OLS_PartCmp);
+}
+
+/*
+ * returns size of largest known flash
+ */
+uint32_t OLS_PartMaxSize(void)
+{
+	uint32_t max = 0;
+	int i;
+
+	for (i = 0; i < parts_num; i++) {
+		uint32_t size = (uint32_t)parts[i].pages * parts[i].page_size;
+
+		if (size > max)
+			max = size;
+	}
+
+	return max;
+}
@@ -0,0 +1,31 @@
+/*
+ * Part of ols-fwloader - database of supported SPI flash parts
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OLS_PARTS_H_
+#define OLS_PARTS_H_
+
+#include <stdint.h>
+
+#include "ols.h"
+
+int OLS_PartLoad(const char *file);
+const struct ols_flash_t *OLS_PartFind(uint32_t jedec);
+uint32_t OLS_PartMaxSize(void);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Part of ols-fwloader - direct libusb transport for APP mode
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "serial.h"
+#include "ols.h"
+#include "ols-usb.h"
+
+#if !IS_WIN32
+
+// CDC class requests
+#define CDC_SET_LINE_CODING        0x20
+#define CDC_SET_CONTROL_LINE_STATE 0x22
+
+struct ols_usb_t {
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+
+	int comm_if;
+	int data_if;
+	int attach[2];
+
+	uint8_t ep_in;
+	uint8_t ep_out;
+	uint16_t max_packet;
+
+	// bytes received but not consumed yet
+	uint8_t rx[OLS_USB_RX_SIZE];
+	int rx_pos;
+	int rx_len;
+};
+
+/*
+ * formats usb port path as "bus-port.port..."
+ */
+void OLS_USB_Path(libusb_device *dev, char *buf, int size)
+{
+	uint8_t ports[8];
+	int len;
+	int n;
+	int i;
+
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	len = snprintf(buf, size, "%d", libusb_get_bus_number(dev));
+
+	for (i = 0; (i < n) && (len < size); i++) {
+		len += snprintf(buf + len, size - len, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+	}
+}
+
+/*
+ * finds CDC comm/data interfaces and bulk endpoints
+ */
+static int OLS_USB_FindEndpoints(struct ols_usb_t *u, libusb_device *dev)
+{
+	struct libusb_config_descriptor *cfg;
+	int i, j;
+
+	if (libusb_get_active_config_descriptor(dev, &cfg) != 0) {
+		return -1;
+	}
+
+	u->comm_if = -1;
+	u->data_if = -1;
+
+	for (i = 0; i < cfg->bNumInterfaces; i++) {
+		const struct libusb_interface_descriptor *id = &cfg->interface[i].altsetting[0];
+
+		if (id->bInterfaceClass == LIBUSB_CLASS_COMM) {
+			u->comm_if = id->bInterfaceNumber;
+			continue;
+		}
+
+		if (id->bInterfaceClass != LIBUSB_CLASS_DATA)
+			continue;
+
+		for (j = 0; j < id->bNumEndpoints; j++) {
+			const struct libusb_endpoint_descriptor *ep = &id->endpoint[j];
+
+			if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+				continue;
+
+			if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+				u->ep_in = ep->bEndpointAddress;
+				u->max_packet = ep->wMaxPacketSize;
+			} else {
+				u->ep_out = ep->bEndpointAddress;
+			}
+		}
+		u->data_if = id->bInterfaceNumber;
+	}
+
+	libusb_free_config_descriptor(cfg);
+
+	if ((u->data_if < 0) || (u->ep_in == 0) || (u->ep_out == 0)) {
+		return -1;
+	}
+
+	if (u->max_packet == 0)
+		u->max_packet = 64;
+
+	return 0;
+}
+
+/*
+ * opens OLS over libusb
+ * port - "usb" for first OLS found, "usb:<bus-path>" or "usb:<serial>"
+ */
+static int OLS_USB_Open(struct ols_t *ols, const char *port, unsigned long speed)
+{
+	struct ols_usb_t *u;
+	libusb_device **list;
+	libusb_device *found = NULL;
+	const char *want = NULL;
+	uint8_t coding[7];
+	ssize_t cnt;
+	int ret;
+	int i;
+
+	if (port[strlen(OLS_USB_PREFIX)] == ':')
+		want = port + strlen(OLS_USB_PREFIX) + 1;
+
+	u = malloc(sizeof(struct ols_usb_t));
+	if (u == NULL) {
+		fprintf(stderr, "Error allocating memory \n");
+		return -1;
+	}
+	memset(u, 0, sizeof(struct ols_usb_t));
+
+	if (libusb_init(&u->ctx) != 0) {
+		fprintf(stderr, "Cannot initialize libusb\n");
+		free(u);
+		return -1;
+	}
+
+	cnt = libusb_get_device_list(u->ctx, &list);
+	for (i = 0; (i < cnt) && (found == NULL); i++) {
+		struct libusb_device_descriptor desc;
+		char path[OLS_USB_PATH_LEN];
+		unsigned char serial[64];
+
+		if (libusb_get_device_descriptor(list[i], &desc) != 0)
+			continue;
+
+		if ((desc.idVendor != OLS_APP_VID) || (desc.idProduct != OLS_APP_PID))
+			continue;
+
+		if (libusb_open(list[i], &u->dev) != 0)
+			continue;
+
+		if (want == NULL) {
+			found = list[i];
+			break;
+		}
+
+		OLS_USB_Path(list[i], path, sizeof(path));
+		serial[0] = 0;
+		if (desc.iSerialNumber)
+			libusb_get_string_descriptor_ascii(u->dev, desc.iSerialNumber, serial, sizeof(serial));
+
+		if ((strcmp(want, path) == 0) || (strcmp(want, (char *)serial) == 0)) {
+			found = list[i];
+			break;
+		}
+
+		libusb_close(u->dev);
+		u->dev = NULL;
+	}
+
+	if ((found == NULL) || OLS_USB_FindEndpoints(u, found)) {
+		fprintf(stderr, "Unable to find OLS on '%s'\n", port);
+		if (u->dev)
+			libusb_close(u->dev);
+		libusb_free_device_list(list, 1);
+		libusb_exit(u->ctx);
+		free(u);
+		return -1;
+	}
+	libusb_free_device_list(list, 1);
+
+	// take both interfaces away from cdc_acm
+	for (i = 0; i < 2; i++) {
+		int intf = (i == 0) ? u->comm_if : u->data_if;
+
+		if (intf < 0)
+			continue;
+
+		if (libusb_kernel_driver_active(u->dev, intf) == 1) {
+			if (libusb_detach_kernel_driver(u->dev, intf)) {
+				fprintf(stderr, "Error detaching kernel driver \n");
+			} else {
+				u->attach[i] = 1;
+			}
+		}
+
+		ret = libusb_claim_interface(u->dev, intf);
+		if (ret != 0) {
+			fprintf(stderr, "Cannot claim USB interface %d\n", intf);
+			ols->usb = u;
+			ols->io->Close(ols);
+			return -1;
+		}
+	}
+
+	// line coding is ignored by device, but keep cdc state sane
+	if (u->comm_if >= 0) {
+		coding[0] = speed & 0xff;
+		coding[1] = (speed >> 8) & 0xff;
+		coding[2] = (speed >> 16) & 0xff;
+		coding[3] = (speed >> 24) & 0xff;
+		coding[4] = 0; // 1 stop bit
+		coding[5] = 0; // no parity
+		coding[6] = 8; // data bits
+
+		libusb_control_transfer(u->dev, 0x21, CDC_SET_LINE_CODING, 0, u->comm_if, coding, sizeof(coding), OLS_USB_TIMEOUT);
+		libusb_control_transfer(u->dev, 0x21, CDC_SET_CONTROL_LINE_STATE, 0x03, u->comm_if, NULL, 0, OLS_USB_TIMEOUT);
+	}
+
+	ols->usb = u;
+	return 0;
+}
+
+static int OLS_USB_Close(struct ols_t *ols)
+{
+	struct ols_usb_t *u = ols->usb;
+	int i;
+
+	if (u == NULL)
+		return 0;
+
+	for (i = 0; i < 2; i++) {
+		int intf = (i == 0) ? u->comm_if : u->data_if;
+
+		if (intf < 0)
+			continue;
+
+		libusb_release_interface(u->dev, intf);
+		if (u->attach[i]) {
+			if (libusb_attach_kernel_driver(u->dev, intf)) {
+				fprintf(stderr, "Unable to reattach kernel driver\n");
+			}
+		}
+	}
+
+	libusb_close(u->dev);
+	libusb_exit(u->ctx);
+	free(u);
+
+	ols->usb = NULL;
+	return 0;
+}
+
+/*
+ * reads size bytes within timeout ms
+ * bulk IN requests are sized to what is still missing, rounded up to
+ * whole packets, so a transfer never waits for data that is not coming
+ */
+static int OLS_USB_Read(struct ols_t *ols, uint8_t *buf, int size, int timeout)
+{
+	struct ols_usb_t *u = ols->usb;
+	uint64_t deadline;
+	uint64_t now;
+	int len = 0;
+	int ret;
+
+	deadline = serial_time_ms() + timeout;
+
+	while (len < size) {
+		int want;
+		int got = 0;
+
+		if (u->rx_pos < u->rx_len) {
+			int n = u->rx_len - u->rx_pos;
+
+			if (n > size - len)
+				n = size - len;
+
+			memcpy(buf + len, u->rx + u->rx_pos, n);
+			u->rx_pos += n;
+			len += n;
+			continue;
+		}
+
+		now = serial_time_ms();
+		if (now >= deadline)
+			break;
+
+		want = size - len;
+		want = (want + u->max_packet - 1) / u->max_packet * u->max_packet;
+		if (want > OLS_USB_RX_SIZE)
+			want = OLS_USB_RX_SIZE;
+
+		// libusb treats 0 as no timeout
+		ret = libusb_bulk_transfer(u->dev, u->ep_in, u->rx, want, &got, (deadline - now) ? (deadline - now) : 1);
+		u->rx_pos = 0;
+		u->rx_len = got;
+
+		if ((ret != 0) && (ret != LIBUSB_ERROR_TIMEOUT)) {
+			fprintf(stderr, "USB read error (%d)\n", ret);
+			return (len > 0) ? len : -1;
+		}
+	}
+
+	return len;
+}
+
+static int OLS_USB_Write(struct ols_t *ols, uint8_t *buf, int size)
+{
+	struct ols_usb_t *u = ols->usb;
+	int done = 0;
+	int ret;
+
+	ret = libusb_bulk_transfer(u->dev, u->ep_out, buf, size, &done, OLS_USB_TIMEOUT);
+	if (ret != 0) {
+		fprintf(stderr, "USB write error (%d)\n", ret);
+		return (done > 0) ? done : -1;
+	}
+
+	return done;
+}
+
+const struct ols_io_t OLS_USB_IO = {
+	.name = "usb",
+	.Open = OLS_USB_Open,
+	.Close = OLS_USB_Close,
+	.Read = OLS_USB_Read,
+	.Write = OLS_USB_Write,
+};
+
+#endif
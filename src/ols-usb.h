@@ -0,0 +1,49 @@
+/*
+ * Part of ols-fwloader - direct libusb transport for APP mode
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OLS_USB_H_
+#define OLS_USB_H_
+
+#include <config.h>
+#include <stdint.h>
+
+#include "ols.h"
+
+// OLS in APP (CDC) mode
+#define OLS_APP_VID     0x04d8
+#define OLS_APP_PID     0xfc92
+
+// ports starting with this prefix use libusb instead of tty
+#define OLS_USB_PREFIX  "usb"
+
+#define OLS_USB_TIMEOUT 1000
+#define OLS_USB_RX_SIZE 4096
+
+// longest "bus-port.port..." path
+#define OLS_USB_PATH_LEN 32
+
+#if !IS_WIN32
+#include <libusb.h>
+
+extern const struct ols_io_t OLS_USB_IO;
+
+void OLS_USB_Path(libusb_device *dev, char *buf, int size);
+#endif
+
+#endif
@@ -25,96 +25,228 @@
 #include "data_file.h"
 #include "serial.h"
 #include "ols.h"
-
-const struct ols_flash_t OLS_Flash[] = {
-	{
-		"\x1f\x24\x00\x00",
-		264, // size of page
-		2048, // number of pages
-		"ATMEL AT45DB041D"
-	},
-	{
-		"\x1f\x23\x00\x00",
-		264, // size of page
-		1024, // number of pages
-		"ATMEL AT45DB021D"
-	},
-	{
-		"\xef\x30\x12\x00",
-		256, // size of page
-		1024, // number of pages
-		"WINBOND W25X20"
-	},
-	{
-		"\xef\x30\x13\x00",
-		256, // size of page
-		2048, // number of pages
-		"WINBOND W25X40"
-	},
-	{
-		"\xef\x30\x14\x00",
-		256, // size of page
-		4096, // number of pages
-		"WINBOND W25X80"
-	},
-	{
-		"\xef\x40\x14\x00",
-		256, // size of page
-		4096, // number of pages
-		"WINBOND W25Q80"
-	},
-};
-
-#define OLS_FLASH_NUM (sizeof(OLS_Flash)/sizeof(struct ols_flash_t))
-
-struct ols_t *OLS_Init(char *port, unsigned long speed)
+#include "ols-cache.h"
+#include "ols-parts.h"
+#include "ols-usb.h"
+
+// timeouts in ms
+#define OLS_TIMEOUT_SYNC     100   // single ID sync probe
+#define OLS_TIMEOUT_CMD      1000  // short command reply, page read/write
+#define OLS_TIMEOUT_DRAIN    50    // line considered quiet
+#define OLS_TIMEOUT_ERASE    20000 // chip erase
+#define OLS_TIMEOUT_SELFTEST 20000
+
+// timeouts derived from part timings are this many times the typical time
+#define OLS_TIMING_MARGIN    5
+
+// page writes queued at once, in time it takes to program them
+#define OLS_QUEUE_US         64000
+
+// reply timeout learned from latency is p99 * margin + slack, it is used
+// once there are enough samples and never exceeds the fixed timeout
+#define OLS_LAT_UPDATE       16
+#define OLS_LAT_MARGIN       4
+#define OLS_LAT_SLACK_MS     20
+
+// wait before first retry of failed page, doubled on every next one
+#define OLS_BACKOFF_MS       20
+#define OLS_BACKOFF_MAX_MS   1000
+
+static int OLS_SerialOpen(struct ols_t *ols, const char *port, unsigned long speed)
 {
-	int fd;
 	int ret;
-	struct ols_t *ols;
 
-	fd = serial_open(port);
-	if (fd < 0) {
+	ols->fd = serial_open(port);
+	if (ols->fd < 0) {
 		fprintf(stderr, "Unable to open port '%s' \n", port);
-		return NULL;
+		return -1;
 	}
 
-	ret = serial_setup(fd, speed);
+	ret = serial_setup(ols->fd, speed);
 	if (ret) {
 		fprintf(stderr, "Unable to set serial port parameters \n");
-		return NULL;
+		serial_close(ols->fd);
+		return -1;
 	}
 
+	return 0;
+}
+
+static int OLS_SerialClose(struct ols_t *ols)
+{
+	return serial_close(ols->fd);
+}
+
+static int OLS_SerialRead(struct ols_t *ols, uint8_t *buf, int size, int timeout)
+{
+	return serial_read(ols->fd, (char *)buf, size, timeout);
+}
+
+static int OLS_SerialWrite(struct ols_t *ols, uint8_t *buf, int size)
+{
+	return serial_write(ols->fd, (char *)buf, size);
+}
+
+static const struct ols_io_t OLS_SERIAL_IO = {
+	.name = "serial",
+	.Open = OLS_SerialOpen,
+	.Close = OLS_SerialClose,
+	.Read = OLS_SerialRead,
+	.Write = OLS_SerialWrite,
+};
+
+static int OLS_Connect(struct ols_t *ols, struct ols_profile_t *cached);
+
+static int OLS_LatCmp(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+ * adds latency sample, percentiles are refreshed every few samples
+ */
+static void OLS_LatAdd(struct ols_lat_t *lat, uint32_t us)
+{
+	uint32_t tmp[OLS_LAT_SAMPLES];
+	uint32_t n;
+
+	lat->us[lat->count % OLS_LAT_SAMPLES] = us;
+	lat->count ++;
+
+	if ((lat->count != OLS_LAT_MIN) && (lat->count % OLS_LAT_UPDATE))
+		return;
+
+	n = (lat->count < OLS_LAT_SAMPLES) ? lat->count : OLS_LAT_SAMPLES;
+	memcpy(tmp, lat->us, n * sizeof(uint32_t));
+	qsort(tmp, n, sizeof(uint32_t), OLS_LatCmp);
+
+	lat->p50_us = tmp[n / 2];
+	lat->p99_us = tmp[(n * 99) / 100];
+}
+
+/*
+ * returns timeout in ms for reply of count commands
+ * fallback - fixed timeout used until enough samples are known
+ */
+static int OLS_LatTimeout(struct ols_lat_t *lat, uint32_t count, int fallback)
+{
+	uint64_t timeout;
+
+	if (lat->count < OLS_LAT_MIN)
+		return fallback;
+
+	timeout = (uint64_t)lat->p99_us * count * OLS_LAT_MARGIN / 1000 + OLS_LAT_SLACK_MS;
+	return (timeout < fallback) ? timeout : fallback;
+}
+
+/*
+ * prints measured latencies and timeouts derived from them
+ */
+void OLS_ProfilePrint(struct ols_t *ols)
+{
+	struct ols_profile_t *p = &ols->profile;
+
+	if (p->read.count >= OLS_LAT_MIN)
+		printf("Read reply p50 %u us, p99 %u us, timeout %d ms/page\n", p->read.p50_us, p->read.p99_us,
+			OLS_LatTimeout(&p->read, 1, OLS_TIMEOUT_CMD));
+	if (p->write.count >= OLS_LAT_MIN)
+		printf("Write reply p50 %u us, p99 %u us, timeout %d ms\n", p->write.p50_us, p->write.p99_us,
+			OLS_LatTimeout(&p->write, 1, OLS_TIMEOUT_CMD));
+	if (p->erase_ms)
+		printf("Chip erase %u ms\n", p->erase_ms);
+}
+
+/*
+ * returns size of largest supported flash
+ */
+uint32_t OLS_MaxFlashSize(void)
+{
+	return OLS_PartMaxSize();
+}
+
+struct ols_t *OLS_Init(char *port, unsigned long speed)
+{
+	int ret;
+	struct ols_t *ols;
+	struct ols_profile_t cached;
+	int have_cache = 0;
+	uint64_t start;
+
 	ols = malloc(sizeof(struct ols_t));
 	if (ols == NULL) {
 		fprintf(stderr, "Error allocating memory \n");
 		return NULL;
 	}
 
-	ols->fd = fd;
+	ols->fd = -1;
+	ols->usb = NULL;
+	ols->io = &OLS_SERIAL_IO;
 	ols->verbose = 0;
 	ols->flash = NULL;
+	ols->window = OLS_WINDOW_DEFAULT;
+	ols->retries = OLS_RETRIES_DEFAULT;
+	ols->retried = 0;
+	ols->resynced = 0;
+	ols->cut_size = 0;
+	memset(&ols->profile, 0, sizeof(ols->profile));
+	ols->cache = NULL;
+	ols->progress = NULL;
+
+	if (strncasecmp(port, OLS_USB_PREFIX, strlen(OLS_USB_PREFIX)) == 0) {
+#if IS_WIN32
+		fprintf(stderr, "USB transport is not supported on this platform\n");
+		free(ols);
+		return NULL;
+#else
+		ols->io = &OLS_USB_IO;
+#endif
+	}
 
-	ret = OLS_GetID(ols);
+	start = serial_time_ms();
+	ret = ols->io->Open(ols, port, speed);
 	if (ret) {
-		fprintf(stderr, "Unable to read ID \n");
 		free(ols);
 		return NULL;
 	}
 
-	ret = OLS_GetFlashID(ols);
+	ols->cache = OLS_CacheFile(port);
+	if (ols->cache != NULL)
+		have_cache = (OLS_CacheLoad(ols->cache, &cached) == 0);
+
+	ret = OLS_Connect(ols, have_cache ? &cached : NULL);
 	if (ret) {
-		fprintf(stderr, "Unable to read Flash ID \n");
+		ols->io->Close(ols);
+		free(ols->cache);
 		free(ols);
 		return NULL;
 	}
 
+	// cached profile is valid only if the same device answered
+	if (have_cache && (memcmp(cached.id, ols->profile.id, sizeof(cached.id)) == 0) &&
+	    (cached.jedec == ols->profile.jedec)) {
+		ols->profile = cached;
+	} else {
+		have_cache = 0;
+	}
+
+	printf("Connected in %u ms%s\n", (unsigned int)(serial_time_ms() - start),
+		have_cache ? " (cached profile)" : "");
+
 	return ols;
 }
 
 int OLS_Deinit(struct ols_t *ols)
 {
-	serial_close(ols->fd);
+	ols->io->Close(ols);
+
+	if (ols->cache != NULL) {
+		if ((ols->flash != NULL) && OLS_CacheSave(ols->cache, &ols->profile))
+			fprintf(stderr, "Unable to save profile to '%s'\n", ols->cache);
+		free(ols->cache);
+	}
 	free(ols);
 
 	return 0;
@@ -128,33 +260,20 @@ int OLS_RunSelftest(struct ols_t *ols)
 {
 	uint8_t cmd[4] = {0x07, 0x00, 0x00, 0x00};
 	uint8_t status;
-	int res, retry;
+	int res;
 
-	res = serial_write(ols->fd, cmd, 4);
+	res = ols->io->Write(ols, cmd, 4);
 	if (res != 4) {
 		printf("Error writing to OLS\n");
 		return -2;
 	}
 
-	retry=0;
-	while (1) {
-		res = serial_read(ols->fd, &status, 1, 100);
-
-		if (res < 1) {
-			retry ++;
-		}
-
-		if (res == 1) {
-			printf("done...\n");
-			break;
-		}
-
-		// 20 second timenout
-		if (retry > 60) {
-			printf("failed :( - timeout\n");
-			return -1;
-		}
+	res = ols->io->Read(ols, &status, 1, OLS_TIMEOUT_SELFTEST);
+	if (res != 1) {
+		printf("failed :( - timeout\n");
+		return -1;
 	}
+	printf("done...\n");
 
 	if(status == 0x00){
 		printf("Passed self-test :) \n");
@@ -188,13 +307,13 @@ int OLS_GetStatus(struct ols_t *ols)
 	uint8_t status;
 	int res;
 
-	res = serial_write(ols->fd, cmd, 4);
+	res = ols->io->Write(ols, cmd, 4);
 	if (res != 4) {
 		printf("Error writing to OLS\n");
 		return -2;
 	}
 
-	res = serial_read(ols->fd, &status, 1, 100);
+	res = ols->io->Read(ols, &status, 1, OLS_TIMEOUT_CMD);
 
 	if (res != 1) {
 		printf("Error reading OLS status\n");
@@ -206,13 +325,26 @@ int OLS_GetStatus(struct ols_t *ols)
 }
 
 /*
- * Reads OLS version
- * ols->fd - fd of ols com port
+ * reads and throws away everything until the line goes quiet
+ * used to resynchronise after broken pipelined transfer
  */
-int OLS_GetID(struct ols_t *ols)
+static void OLS_Drain(struct ols_t *ols)
 {
-	uint8_t cmd[4] = {0x00, 0x00, 0x00, 0x00};
-	uint8_t ret[7];
+	uint8_t tmp[OLS_PAGE_SIZE_MAX];
+
+	while (ols->io->Read(ols, tmp, sizeof(tmp), OLS_TIMEOUT_DRAIN) > 0);
+}
+
+/*
+ * brings sender and receiver in sync by sending single 0x00 until the
+ * ID reply shows up
+ * ret - 7 bytes of ID reply
+ *
+ * returns 0 if in sync, -1 on no reply, -2 on write error, -3 on invalid reply
+ */
+static int OLS_Sync(struct ols_t *ols, uint8_t *ret)
+{
+	uint8_t cmd[1] = {0x00};
 	int res;
 	int i;
 
@@ -220,14 +352,13 @@ int OLS_GetID(struct ols_t *ols)
 
 	for (i = 0; i < 7; i++) {
 		/* Write a single 0x00 until we get a response */
-		res = serial_write(ols->fd, cmd, 1);
+		res = ols->io->Write(ols, cmd, 1);
 
 		if (res != 1) {
-			printf("Error writing to OLS\n");
 			return -2;
 		}
 
-		res = serial_read(ols->fd, ret, 1, 1);
+		res = ols->io->Read(ols, ret, 1, OLS_TIMEOUT_SYNC);
 		if (res == 1) {
 			if (ret[0] == 'H') {
 				/* Found response */
@@ -238,25 +369,55 @@ int OLS_GetID(struct ols_t *ols)
 	}
 
 	if (ret[0] != 'H') {
-		printf("Error reading OLS version id\n");
 		return -1;
 	}
 
 	/* Read the following 6 response bytes */
 
-	res = serial_read(ols->fd, ret + 1, 6, 10);
+	res = ols->io->Read(ols, ret + 1, 6, OLS_TIMEOUT_CMD);
 	if (res != 6) {
-		printf("Error reading OLS version id\n");
 		return -1;
 	}
 
 	/* Now the sender and receiver are in sync */
 
 	if (ret[0] != 'H' || ret[2] != 'F' || ret[5] != 'B') {
+		return -3;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads OLS version
+ * ols->fd - fd of ols com port
+ */
+int OLS_GetID(struct ols_t *ols)
+{
+	uint8_t ret[7];
+	int res;
+
+	res = OLS_Sync(ols, ret);
+	if (res == -2) {
+		printf("Error writing to OLS\n");
+		return -2;
+	}
+
+	if (res == -3) {
 		printf("Error reading OLS id - invalid data returned\n");
 		return -1;
 	}
 
+	if (res) {
+		printf("Error reading OLS version id\n");
+		return -1;
+	}
+
+	ols->profile.id[0] = ret[1];
+	ols->profile.id[1] = ret[3];
+	ols->profile.id[2] = ret[4];
+	ols->profile.id[3] = ret[6];
+
 	printf("Found OLS HW: %d, FW: %d.%d, Boot: %d\n", ret[1], ret[3], ret[4], ret[6]);
 	return 0;
 }
@@ -270,7 +431,7 @@ int OLS_EnterBootloader(struct ols_t *ols)
 	uint8_t cmd[4] = {0x24, 0x24, 0x24, 0x24};
 	int res;
 
-	res = serial_write(ols->fd, cmd, 4);
+	res = ols->io->Write(ols, cmd, 4);
 	if (res != 4) {
 		printf("Error writing to OLS\n");
 		return -2;
@@ -289,7 +450,7 @@ int OLS_EnterRunMode(struct ols_t *ols)
 	uint8_t cmd[4] = {0xFF, 0xFF, 0xFF, 0xFF};
 	int res;
 
-	res = serial_write(ols->fd, cmd, 4);
+	res = ols->io->Write(ols, cmd, 4);
 	if (res != 4) {
 		printf("Error writing to OLS\n");
 		return -2;
@@ -307,15 +468,14 @@ int OLS_GetFlashID(struct ols_t *ols) {
 	uint8_t cmd[4] = {0x01, 0x00, 0x00, 0x00};
 	uint8_t ret[4];
 	int res;
-	int i;
 
-	res = serial_write(ols->fd, cmd, 4);
+	res = ols->io->Write(ols, cmd, 4);
 	if (res != 4) {
 		printf("Error writing to OLS\n");
 		return -2;
 	}
 
-	res = serial_read(ols->fd, ret, 4, 10);
+	res = ols->io->Read(ols, ret, 4, OLS_TIMEOUT_CMD);
 	if (res != 4) {
 		printf("Error reading JEDEC ID\n");
 		return -1;
@@ -326,15 +486,11 @@ int OLS_GetFlashID(struct ols_t *ols) {
 		return -1;
 	}
 
-	for (i = 0; i < OLS_FLASH_NUM; i++) {
-		if (memcmp(ret, OLS_Flash[i].jedec_id, 4) == 0) {
-			ols->flash = (struct ols_flash_t *)&OLS_Flash[i];
-			printf("Found flash: %s \n", OLS_Flash[i].name);
-			break;
-		}
-	}
-
-	if(ols->flash == NULL) {
+	ols->profile.jedec = (ret[0] << 24) | (ret[1] << 16) | (ret[2] << 8) | ret[3];
+	ols->flash = OLS_PartFind(ols->profile.jedec);
+	if (ols->flash != NULL) {
+		printf("Found flash: %s \n", ols->flash->name);
+	} else {
 		printf("Error - unknown flash type (%02x %02x %02x %02x)\n", ret[0], ret[1], ret[2], ret[3]);
 		printf("Is OLS in update mode ??\n");
 		return -1;
@@ -343,6 +499,130 @@ int OLS_GetFlashID(struct ols_t *ols) {
 	return 0;
 }
 
+/*
+ * returns 1 if ID reply is valid and, when id is given, comes from
+ * device with that id
+ * ret - 7 bytes of ID reply
+ * id - 4 id bytes (see ols_profile_t), may be NULL
+ */
+static int OLS_IdMatch(uint8_t *ret, const uint8_t *id)
+{
+	if ((ret[0] != 'H') || (ret[2] != 'F') || (ret[5] != 'B'))
+		return 0;
+
+	if (id == NULL)
+		return 1;
+
+	return (ret[1] == id[0]) && (ret[3] == id[1]) && (ret[4] == id[2]) && (ret[6] == id[3]);
+}
+
+/*
+ * sends whole ID command and checks its single reply. Cheap check that
+ * device which was in sync before still is.
+ * id - 4 id bytes expected
+ *
+ * returns 0 if in sync, -1 on no or other reply, -2 on write error
+ */
+static int OLS_Probe(struct ols_t *ols, const uint8_t *id)
+{
+	uint8_t cmd[4] = {0x00, 0x00, 0x00, 0x00};
+	uint8_t ret[7];
+
+	if (ols->io->Write(ols, cmd, 4) != 4)
+		return -2;
+
+	if (ols->io->Read(ols, ret, 7, OLS_TIMEOUT_SYNC) != 7)
+		return -1;
+
+	return OLS_IdMatch(ret, id) ? 0 : -1;
+}
+
+/*
+ * sends OLS and flash id commands at once, device which is in sync
+ * answers both in single round trip
+ * cached - profile of device seen on this port before, both ids have to
+ *          match it, may be NULL
+ *
+ * returns 0 if flash was found, -1 on no or other reply, -2 on write error
+ */
+static int OLS_Burst(struct ols_t *ols, struct ols_profile_t *cached)
+{
+	uint8_t cmd[8] = {0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00};
+	uint8_t ret[11];
+	uint32_t jedec;
+	int res;
+
+	res = ols->io->Write(ols, cmd, 8);
+	if (res != 8)
+		return -2;
+
+	// 7 bytes of OLS id followed by 4 bytes of JEDEC id
+	res = ols->io->Read(ols, ret, 11, OLS_TIMEOUT_SYNC);
+	if ((res != 11) || !OLS_IdMatch(ret, cached ? cached->id : NULL) ||
+	    ((ret[7] == 'H') && (ret[9] == 'F')))
+		return -1;
+
+	jedec = (ret[7] << 24) | (ret[8] << 16) | (ret[9] << 8) | ret[10];
+	if ((cached != NULL) && (cached->jedec != jedec))
+		return -1;
+
+	ols->flash = OLS_PartFind(jedec);
+	if (ols->flash == NULL)
+		return -1;
+
+	ols->profile.id[0] = ret[1];
+	ols->profile.id[1] = ret[3];
+	ols->profile.id[2] = ret[4];
+	ols->profile.id[3] = ret[6];
+	ols->profile.jedec = jedec;
+
+	printf("Found OLS HW: %d, FW: %d.%d, Boot: %d\n", ret[1], ret[3], ret[4], ret[6]);
+	printf("Found flash: %s \n", ols->flash->name);
+	return 0;
+}
+
+/*
+ * reads OLS and flash id in single burst. Device seen before on this
+ * port gets second burst once the line is drained, bytewise sync is the
+ * fallback for devices not cached, or not answering bursts.
+ * cached - profile of last session, may be NULL
+ */
+static int OLS_Connect(struct ols_t *ols, struct ols_profile_t *cached)
+{
+	int res;
+
+	res = OLS_Burst(ols, cached);
+	if (res == -2) {
+		printf("Error writing to OLS\n");
+		return -2;
+	}
+	if (res == 0)
+		return 0;
+
+	// out of sync, or flash needs the full error report
+	OLS_Drain(ols);
+
+	if (cached != NULL) {
+		if (OLS_Burst(ols, cached) == 0)
+			return 0;
+		OLS_Drain(ols);
+	}
+
+	res = OLS_GetID(ols);
+	if (res) {
+		fprintf(stderr, "Unable to read ID \n");
+		return res;
+	}
+
+	res = OLS_GetFlashID(ols);
+	if (res) {
+		fprintf(stderr, "Unable to read Flash ID \n");
+		return res;
+	}
+
+	return 0;
+}
+
 /*
  * erases OLS flash
  * ols->fd - fd of ols com port
@@ -351,15 +631,16 @@ int OLS_FlashErase(struct ols_t *ols)
 {
 	uint8_t cmd[4] = {0x04, 0x00, 0x00, 0x00};
 	uint8_t status;
+	uint64_t start;
+	int timeout;
 	int res;
-	int retry = 0;
 
 	if (ols->flash == NULL) {
 		printf("Cannot erase unknown flash\n");
 		return -3;
 	}
 
-	res = serial_write(ols->fd, cmd, 4);
+	res = ols->io->Write(ols, cmd, 4);
 	if (res != 4) {
 		printf("Error writing to OLS\n");
 		return -2;
@@ -367,41 +648,204 @@ int OLS_FlashErase(struct ols_t *ols)
 
 	printf("Chip erase ... ");
 
-	while (1) {
-		res = serial_read(ols->fd, &status, 1, 100);
+	fflush(stdout);
 
-		if (res <1) {
-			retry ++;
-		}
+	// single wait, the reply arrives when erase is finished
+	timeout = ols->flash->erase_ms * OLS_TIMING_MARGIN;
+	if (timeout < OLS_TIMEOUT_ERASE)
+		timeout = OLS_TIMEOUT_ERASE;
 
-		if (res == 1) {
-			if (status == 0x01) {
-				printf("done :)\n");
-				return 0;
-			}
-			printf("failed :( - bad reply '%x' Number of reply bytes: %x \n", status, res);
-			return -1;
-		}
+	start = serial_time_ms();
+	res = ols->io->Read(ols, &status, 1, timeout);
+	if (res != 1) {
+		printf("failed :( - timeout\n");
+		return -1;
+	}
 
-		// 20 second timenout
-		if (retry > 60) {
-			printf("failed :( - timeout\n");
-			return -1;
-		}
+	if (status != 0x01) {
+		printf("failed :( - bad reply '%x' Number of reply bytes: %x \n", status, res);
+		return -1;
 	}
 
+	ols->profile.erase_ms = serial_time_ms() - start;
+
+	printf("done :)\n");
 	return 0;
 }
 
+/*
+ * fills address part of page command
+ * cmd - 4 byte command buffer
+ * page - page number
+ */
+static void OLS_PageAddr(struct ols_t *ols, uint8_t *cmd, uint32_t page)
+{
+	uint32_t addr = (uint32_t)page << ols->flash->addr_shift;
+
+	// 264 byte pages of AT45 are addressed by 9 bits
+	cmd[1] = (addr >> 16) & 0xff;
+	cmd[2] = (addr >> 8) & 0xff;
+	cmd[3] = addr & 0xff;
+}
+
 /*
  * Reads data from flash
  * ols->fd - fd of ols com port
  * page - which page should be read
  * buf - buffer where the data will be stored
  */
-int OLS_FlashRead(struct ols_t *ols, uint16_t page, uint8_t *buf)
+int OLS_FlashRead(struct ols_t *ols, uint32_t page, uint8_t *buf)
+{
+	int res;
+
+	res = OLS_FlashReadMulti(ols, page, 1, buf);
+	if (res < 0)
+		return res;
+
+	return (res == 1) ? 0 : -1;
+}
+
+/*
+ * returns number of commands that may be in flight
+ */
+static int OLS_Window(struct ols_t *ols)
+{
+	if (ols->window < 1)
+		return 1;
+	if (ols->window > OLS_WINDOW_MAX)
+		return OLS_WINDOW_MAX;
+	return ols->window;
+}
+
+/*
+ * returns number of page writes that may be in flight, queued
+ * programming time of slow parts is kept bounded
+ */
+static int OLS_WriteWindow(struct ols_t *ols)
+{
+	int window = OLS_Window(ols);
+	int max;
+
+	if (ols->flash->program_us == 0)
+		return window;
+
+	max = OLS_QUEUE_US / ols->flash->program_us;
+	if (max < 1)
+		max = 1;
+
+	return (window > max) ? max : window;
+}
+
+/*
+ * returns timeout of page write reply in ms
+ */
+static int OLS_WriteTimeout(struct ols_t *ols)
+{
+	int timeout = ols->flash->program_us * OLS_TIMING_MARGIN / 1000;
+
+	return (timeout > OLS_TIMEOUT_CMD) ? timeout : OLS_TIMEOUT_CMD;
+}
+
+/*
+ * keeps command which write cut short, so its rest can be sent before
+ * resync. Checksum of cut write frame is broken, the device then rejects
+ * the frame instead of programming the page with whatever completes it.
+ * cmd - whole command or frame
+ * size - its size
+ * sent - bytes of it written, nothing is kept unless 0 < sent < size
+ */
+static void OLS_CutSave(struct ols_t *ols, uint8_t *cmd, int size, int sent)
+{
+	if ((sent <= 0) || (sent >= size))
+		return;
+
+	memcpy(ols->cut, cmd, size);
+	if (cmd[0] == 0x02)
+		ols->cut[size - 1] ++;
+
+	ols->cut_size = size;
+	ols->cut_sent = sent;
+}
+
+/*
+ * gets command stream back in sync after page failed, so transfer can
+ * continue from that page. Waits twice as long before every next try.
+ * page - page which failed
+ * tries - retries of this page so far, updated
+ *
+ * returns 0 if page may be tried again, -1 if out of retries
+ */
+static int OLS_Retry(struct ols_t *ols, uint32_t page, int *tries)
+{
+	uint8_t id[7];
+	uint32_t wait;
+	int res;
+
+	while (*tries < ols->retries) {
+		wait = OLS_BACKOFF_MS << *tries;
+		if (wait > OLS_BACKOFF_MAX_MS)
+			wait = OLS_BACKOFF_MAX_MS;
+
+		(*tries) ++;
+		ols->retried ++;
+		printf("\nPage 0x%04x failed, retry %d/%d in %u ms\n", page, *tries, ols->retries, wait);
+
+		// device waits for the rest of cut command, its reply is
+		// drained after the wait
+		if (ols->cut_size) {
+			res = ols->io->Write(ols, ols->cut + ols->cut_sent, ols->cut_size - ols->cut_sent);
+			if (res > 0)
+				ols->cut_sent += res;
+			if (ols->cut_sent < ols->cut_size) {
+				printf("Resync failed\n");
+				continue;
+			}
+			ols->cut_size = 0;
+		}
+
+		serial_sleep_ms(wait);
+		OLS_Drain(ols);
+
+		// device answered before, one whole ID command confirms sync,
+		// bytewise sync only when it does not
+		res = OLS_Probe(ols, ols->profile.id);
+		if (res == -1) {
+			OLS_Drain(ols);
+			res = OLS_Sync(ols, id);
+		}
+
+		if (res == 0) {
+			ols->resynced ++;
+			return 0;
+		}
+		printf("Resync failed\n");
+	}
+
+	return -1;
+}
+
+/*
+ * reads consecutive pages from flash, keeping up to ols->window read
+ * commands queued. Replies are streamed straight into buf.
+ * buf - count pages, or ring of ring pages reused while reading
+ * each - called for every page read, stops reading by returning non-zero
+ * stop - set when each() stopped reading
+ *
+ * returns number of pages read successfully (passed to each)
+ */
+static int OLS_FlashReadPages(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *buf, uint32_t ring,
+	int (*each)(void *, uint32_t, uint8_t *), void *ctx, int *stop)
 {
-	uint8_t cmd[4] = {0x03, 0x00, 0x00, 0x00};
+	uint8_t cmd[4 * OLS_WINDOW_MAX];
+	uint32_t sent = 0;
+	uint32_t done = 0;
+	uint16_t page_size;
+	uint32_t chunk;
+	uint32_t slot;
+	uint32_t i;
+	uint64_t start;
+	int window;
+	int n;
 	int res;
 
 	if (ols->flash == NULL) {
@@ -409,38 +853,184 @@ int OLS_FlashRead(struct ols_t *ols, uint16_t page, uint8_t *buf)
 		return -3;
 	}
 
-	if (page > ols->flash->pages) {
-		printf("You are trying to read page %d, but we have only %d !\n", page, ols->flash->pages);
+	if (page + count > ols->flash->pages) {
+		printf("You are trying to read page %d, but we have only %d !\n", page + count - 1, ols->flash->pages);
 		return -2;
 	}
 
-	if(ols->flash->page_size == 264){//ATMEL ROM with 264 byte pages
-		cmd[1] = (page >> 7) & 0xff;
-		cmd[2] = (page << 1) & 0xff;
-	} else { //most 256 byte page roms
-		cmd[1] = (page >> 8) & 0xff;
-		cmd[2] = (page) & 0xff;
+	page_size = ols->flash->page_size;
+	window = OLS_Window(ols);
+
+	while (done < count) {
+		// queue read commands for free slots in one go
+		n = 0;
+		while ((sent < count) && (sent - done < window)) {
+			cmd[n + 0] = 0x03;
+			cmd[n + 3] = 0x00;
+			OLS_PageAddr(ols, cmd + n, page + sent);
+			n += 4;
+			sent ++;
+		}
+
+		if (n > 0) {
+			res = ols->io->Write(ols, cmd, n);
+			if (res != n) {
+				printf("Error writing CMD to OLS\n");
+				if (res > 0)
+					OLS_CutSave(ols, cmd + res / 4 * 4, 4, res % 4);
+
+				// replies only of commands which went out whole
+				if ((sent - n / 4 > done) || (res >= 4))
+					OLS_Drain(ols);
+				return done;
+			}
+		}
+
+		// drain half of what is in flight in one large read,
+		// the other half keeps the device busy meanwhile
+		chunk = (sent - done + 1) / 2;
+
+		// ring is filled up to its end, wraps on next read
+		slot = ring ? (done % ring) : done;
+		if (ring && (chunk > ring - slot))
+			chunk = ring - slot;
+
+		start = serial_time_us();
+		res = ols->io->Read(ols, buf + slot * page_size, chunk * page_size,
+			OLS_LatTimeout(&ols->profile.read, chunk, OLS_TIMEOUT_CMD));
+		if (res != chunk * page_size) {
+			// a lost reply shifts all that follow, so nothing of
+			// this chunk can be trusted
+			printf("Page 0x%04x read failed :(\n", page + done);
+			OLS_Drain(ols);
+			return done;
+		}
+		OLS_LatAdd(&ols->profile.read, (serial_time_us() - start) / chunk);
+
+		for (i = 0; i < chunk; i++, done++) {
+			if (ols->progress)
+				ols->progress(ols, page + done);
+			else if (ols->verbose)
+				printf("Page 0x%04x read ... OK\n", page + done);
+			else if (((page + done) % 32) == 0) {
+				printf(".");
+				fflush(stdout);
+			}
+
+			if (each && each(ctx, page + done, buf + (slot + i) * page_size)) {
+				// rest of in-flight replies is not wanted
+				*stop = 1;
+				if (sent > done + 1)
+					OLS_Drain(ols);
+				return done + 1;
+			}
+		}
 	}
 
-	if (ols->verbose)
-		printf("Page 0x%04x read ... ", page);
+	return done;
+}
 
-	res = serial_write(ols->fd, cmd, 4);
-	if (res != 4) {
-		printf("Error writing CMD to OLS\n");
-		return -2;
+/*
+ * reads consecutive pages from flash
+ * ols->fd - fd of ols com port
+ * page - first page to be read
+ * count - number of pages
+ * buf - buffer where the data will be stored (count * page_size)
+ *
+ * returns number of pages read successfully
+ */
+int OLS_FlashReadMulti(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *buf)
+{
+	uint32_t done = 0;
+	int tries = 0;
+	int stop = 0;
+	int res;
+
+	while (done < count) {
+		res = OLS_FlashReadPages(ols, page + done, count - done, buf + done * ols->flash->page_size,
+			0, NULL, NULL, &stop);
+		if (res < 0)
+			return res;
+
+		if (res > 0)
+			tries = 0;
+		done += res;
+
+		if ((done < count) && OLS_Retry(ols, page + done, &tries))
+			break;
 	}
 
-	res = serial_read(ols->fd, buf, ols->flash->page_size, 100);
+	return done;
+}
 
-	if (res == ols->flash->page_size) {
-		if (ols->verbose)
-			printf("OK\n");
-		return 0;
+/*
+ * reads consecutive pages from flash into small ring buffer, every page
+ * is passed to each() as soon as it arrives
+ * ring - buffer of ring_pages pages (ols->window pages is enough)
+ * each - returns non-zero to stop reading, page it got counts as read
+ *
+ * returns number of pages passed to each()
+ */
+int OLS_FlashReadRing(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *ring, uint32_t ring_pages,
+	int (*each)(void *ctx, uint32_t page, uint8_t *data), void *ctx)
+{
+	uint32_t done = 0;
+	int tries = 0;
+	int stop = 0;
+	int res;
+
+	if (ring_pages == 0)
+		return -1;
+
+	while (done < count) {
+		res = OLS_FlashReadPages(ols, page + done, count - done, ring, ring_pages, each, ctx, &stop);
+		if (res < 0)
+			return res;
+
+		if (res > 0)
+			tries = 0;
+		done += res;
+
+		if (stop)
+			break;
+
+		if ((done < count) && OLS_Retry(ols, page + done, &tries))
+			break;
 	}
 
-	printf("Failed :(\n");
-	return -1;
+	return done;
+}
+
+/*
+ * sends one page frame (cmd, data, checksum) in a single write
+ * ols->fd - fd of ols com port
+ * page - where the data should be written to
+ * buf - data to be written
+ */
+static int OLS_SendPage(struct ols_t *ols, uint32_t page, uint8_t *buf)
+{
+	uint8_t frame[4 + OLS_PAGE_SIZE_MAX + 1];
+	uint16_t size = ols->flash->page_size;
+	int res;
+
+	frame[0] = 0x02;
+	frame[3] = 0x00;
+	OLS_PageAddr(ols, frame, page);
+
+	memcpy(frame + 4, buf, size);
+	frame[4 + size] = Data_Checksum(buf, size);
+
+	if (ols->verbose)
+		printf("Page 0x%04x write ... (0x%04x 0x%04x)\n", page, frame[1], frame[2]);
+
+	res = ols->io->Write(ols, frame, 4 + size + 1);
+	if (res != 4 + size + 1) {
+		printf("Error writing CMD to OLS\n");
+		OLS_CutSave(ols, frame, 4 + size + 1, res);
+		return -2;
+	}
+
+	return 0;
 }
 
 /*
@@ -449,11 +1039,38 @@ int OLS_FlashRead(struct ols_t *ols, uint16_t page, uint8_t *buf)
  * page - where the data should be written to
  * buf - data to be written
  */
-int OLS_FlashWrite(struct ols_t *ols, uint16_t page, uint8_t *buf)
+int OLS_FlashWrite(struct ols_t *ols, uint32_t page, uint8_t *buf)
 {
-	uint8_t cmd[4] = {0x02, 0x00, 0x00, 0x00};
+	int res;
+
+	res = OLS_FlashWriteMulti(ols, page, 1, buf);
+	if (res < 0)
+		return res;
+
+	return (res == 1) ? 0 : -1;
+}
+
+/*
+ * writes consecutive pages to flash, keeping up to ols->window
+ * page frames in flight. Status bytes are collected in order, on first
+ * bad status the remaining in-flight replies are drained.
+ * ols->fd - fd of ols com port
+ * page - first page to be written
+ * count - number of pages
+ * buf - data to be written (count * page_size)
+ *
+ * returns number of pages written successfully, write should be
+ * restarted from page + returned value
+ */
+static int OLS_FlashWritePages(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *buf)
+{
+	uint32_t sent = 0;
+	uint32_t acked = 0;
+	uint32_t todo;
 	uint8_t status;
-	uint8_t chksum;
+	int window;
+	uint64_t start;
+	int timeout;
 	int res;
 
 	if (ols->flash == NULL) {
@@ -461,46 +1078,318 @@ int OLS_FlashWrite(struct ols_t *ols, uint16_t page, uint8_t *buf)
 		return -3;
 	}
 
-	if (page > ols->flash->pages) {
-		printf("You are trying to Write page %d, but we have only %d !\n", page, ols->flash->pages);
+	if (page + count > ols->flash->pages) {
+		printf("You are trying to Write page %d, but we have only %d !\n", page + count - 1, ols->flash->pages);
 		return -2;
 	}
 
-	if(ols->flash->page_size == 264){//ATMEL ROM with 264 byte pages
-		cmd[1] = (page >> 7) & 0xff;
-		cmd[2] = (page << 1) & 0xff;
-	} else { //most 256 byte page roms
-		cmd[1] = (page >> 8) & 0xff;
-		cmd[2] = (page) & 0xff;
+	if (ols->flash->page_size > OLS_PAGE_SIZE_MAX) {
+		printf("Page size %d not supported\n", ols->flash->page_size);
+		return -3;
 	}
 
-	chksum = Data_Checksum(buf, ols->flash->page_size);
+	window = OLS_WriteWindow(ols);
+	timeout = OLS_WriteTimeout(ols);
+
+	todo = count;
+	while (acked < todo) {
+		// keep the window full
+		while ((sent < todo) && (sent - acked < window)) {
+			res = OLS_SendPage(ols, page + sent, buf + sent * ols->flash->page_size);
+			if (res) {
+				// collect what is in flight, then stop
+				todo = sent;
+				break;
+			}
+			sent ++;
+		}
 
-	if (ols->verbose)
-		printf("Page 0x%04x write ... (0x%04x 0x%04x)", page, cmd[1], cmd[2]);
+		if (acked == sent)
+			break;
 
-	res = serial_write(ols->fd, cmd, 4);
-	res += serial_write(ols->fd, buf, ols->flash->page_size);
-	res += serial_write(ols->fd, &chksum, 1);
-	if (res != 4 + 1 + ols->flash->page_size) {
-		printf("Error writing CMD to OLS\n");
+		start = serial_time_us();
+		res = ols->io->Read(ols, &status, 1, OLS_LatTimeout(&ols->profile.write, 1, timeout));
+		if (res != 1) {
+			printf("Page 0x%04x writing timeout\n", page + acked);
+			break;
+		}
+		OLS_LatAdd(&ols->profile.write, serial_time_us() - start);
+
+		if (status != 0x01) {
+			printf("Page 0x%04x checksum error :(\n", page + acked);
+			break;
+		}
+
+		if (ols->progress)
+			ols->progress(ols, page + acked);
+		else if (ols->verbose)
+			printf("Page 0x%04x OK\n", page + acked);
+		else if (((page + acked) % 32) == 0) {
+			printf(".");
+			fflush(stdout);
+		}
+
+		acked ++;
+	}
+
+	// drain replies of pages sent after the failed one, all of them are
+	// due within single deadline as queued programming is bounded
+	if (acked < sent) {
+		uint8_t rest[OLS_WINDOW_MAX];
+
+		if (sent - acked > 1)
+			ols->io->Read(ols, rest, sent - acked - 1, timeout + OLS_QUEUE_US / 1000);
+		OLS_Drain(ols);
+	}
+
+	return acked;
+}
+
+/*
+ * writes consecutive pages to flash, failed page is retried after resync
+ * ols->fd - fd of ols com port
+ * page - first page to be written
+ * count - number of pages
+ * buf - data to be written (count * page_size)
+ *
+ * returns number of pages written successfully
+ */
+int OLS_FlashWriteMulti(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *buf)
+{
+	uint32_t done = 0;
+	int tries = 0;
+	int res;
+
+	while (done < count) {
+		res = OLS_FlashWritePages(ols, page + done, count - done, buf + done * ols->flash->page_size);
+		if (res < 0)
+			return res;
+
+		if (res > 0)
+			tries = 0;
+		done += res;
+
+		if ((done < count) && OLS_Retry(ols, page + done, &tries))
+			break;
+	}
+
+	return done;
+}
+
+// pipelined op, replies are matched to ops in order
+struct ols_op_t {
+	uint8_t read;
+	uint8_t tries;
+	uint32_t idx;
+};
+
+#define OLS_OPS_MAX (2 * OLS_WINDOW_MAX)
+
+/*
+ * writes consecutive pages to flash and reads every page back on the same
+ * command queue as soon as its write is acknowledged, so verify ends
+ * together with write. Page which reads back different is written again
+ * (up to OLS_REWRITE_MAX times).
+ * page - first page to be written
+ * count - number of pages
+ * buf - data to be written (count * page_size)
+ * each - compares page read back, returns non-zero if it differs.
+ *        last is set when page won't be written again, non-zero return
+ *        then stops the whole transfer
+ *
+ * returns number of pages written and checked, less than count on failure
+ */
+static int OLS_FlashWriteVerifyPages(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *buf,
+	int (*each)(void *ctx, uint32_t page, uint8_t *data, int last), void *ctx, int *stop)
+{
+	struct ols_op_t ops[OLS_OPS_MAX];
+	uint8_t data[OLS_PAGE_SIZE_MAX];
+	uint8_t cmd[4];
+	uint16_t page_size;
+	uint32_t head = 0;	// oldest op in flight
+	uint32_t sent = 0;	// next op to be sent
+	uint32_t tail = 0;	// end of ops waiting to be sent
+	uint32_t next = 0;	// next page not queued yet
+	uint32_t checked = 0;
+	uint32_t low;
+	struct ols_op_t op;
+	struct ols_op_t *q;
+	uint8_t status;
+	int window;
+	uint64_t start;
+	int timeout;
+	int last;
+	int res;
+
+	if (ols->flash == NULL) {
+		printf("Cannot Write unknown flash\n");
+		return -3;
+	}
+
+	if (page + count > ols->flash->pages) {
+		printf("You are trying to Write page %d, but we have only %d !\n", page + count - 1, ols->flash->pages);
 		return -2;
 	}
 
-	res = serial_read(ols->fd, &status, 1, 100);
+	page_size = ols->flash->page_size;
+	if (page_size > OLS_PAGE_SIZE_MAX) {
+		printf("Page size %d not supported\n", page_size);
+		return -3;
+	}
+
+	window = OLS_WriteWindow(ols);
+	timeout = OLS_WriteTimeout(ols);
+
+	while (checked < count) {
+		// keep the window full, read backs and rewrites go first
+		while (sent - head < window) {
+			if (tail == sent) {
+				if (next >= count)
+					break;
+				q = &ops[tail++ % OLS_OPS_MAX];
+				q->read = 0;
+				q->tries = 0;
+				q->idx = next++;
+			}
 
-	if (res != 1) {
-		printf("Page writing timeout\n");
-		return -1;
+			q = &ops[sent % OLS_OPS_MAX];
+			if (q->read) {
+				cmd[0] = 0x03;
+				cmd[3] = 0x00;
+				OLS_PageAddr(ols, cmd, page + q->idx);
+				res = ols->io->Write(ols, cmd, 4);
+				if (res != 4) {
+					printf("Error writing CMD to OLS\n");
+					OLS_CutSave(ols, cmd, 4, res);
+				}
+				res = (res == 4) ? 0 : -1;
+			} else {
+				res = OLS_SendPage(ols, page + q->idx, buf + q->idx * page_size);
+			}
+
+			if (res)
+				goto fail;
+			sent ++;
+		}
+
+		if (head == sent)
+			break;
+
+		// op stays in flight until its reply is handled
+		op = ops[head % OLS_OPS_MAX];
+
+		if (!op.read) {
+			start = serial_time_us();
+			res = ols->io->Read(ols, &status, 1, OLS_LatTimeout(&ols->profile.write, 1, timeout));
+			if (res != 1) {
+				printf("Page 0x%04x writing timeout\n", page + op.idx);
+				goto fail;
+			}
+			OLS_LatAdd(&ols->profile.write, serial_time_us() - start);
+
+			if (status != 0x01) {
+				printf("Page 0x%04x checksum error :(\n", page + op.idx);
+				goto fail;
+			}
+
+			if (ols->progress)
+				ols->progress(ols, page + op.idx);
+			else if (ols->verbose)
+				printf("Page 0x%04x OK\n", page + op.idx);
+			else if (((page + op.idx) % 32) == 0) {
+				printf(".");
+				fflush(stdout);
+			}
+
+			// page is in flash now, read it back behind pages in flight
+			head ++;
+			op.read = 1;
+			ops[tail++ % OLS_OPS_MAX] = op;
+			continue;
+		}
+
+		start = serial_time_us();
+		res = ols->io->Read(ols, data, page_size, OLS_LatTimeout(&ols->profile.read, 1, timeout));
+		if (res != page_size) {
+			printf("Page 0x%04x read failed :(\n", page + op.idx);
+			goto fail;
+		}
+		OLS_LatAdd(&ols->profile.read, serial_time_us() - start);
+
+		head ++;
+
+		last = (op.tries >= OLS_REWRITE_MAX);
+		if (each(ctx, page + op.idx, data, last)) {
+			if (last) {
+				*stop = 1;
+				goto fail;
+			}
+
+			if (ols->verbose)
+				printf("Page 0x%04x differs, writing again\n", page + op.idx);
+
+			op.read = 0;
+			op.tries ++;
+			ops[tail++ % OLS_OPS_MAX] = op;
+			continue;
+		}
+
+		if (ols->progress)
+			ols->progress(ols, page + op.idx);
+		else if (ols->verbose)
+			printf("Page 0x%04x verify ... OK\n", page + op.idx);
+
+		checked ++;
 	}
 
-	if (status == 0x01) {
-		if (ols->verbose)
-			printf("OK\n");
-		return 0;
+	return checked;
+
+fail:
+	// replies of other ops in flight are of mixed size
+	if (sent != head)
+		OLS_Drain(ols);
+
+	// pages below the lowest one still pending are done
+	low = next;
+	for (; head != tail; head++) {
+		if (ops[head % OLS_OPS_MAX].idx < low)
+			low = ops[head % OLS_OPS_MAX].idx;
 	}
 
-	printf("Checksum error :(\n");
-	return -1;
+	return low;
 }
 
+/*
+ * writes consecutive pages to flash and reads them back, see
+ * OLS_FlashWriteVerifyPages. Transfer continues after resync from lowest
+ * page which was not checked yet.
+ *
+ * returns number of pages written and checked, less than count on failure
+ */
+int OLS_FlashWriteVerify(struct ols_t *ols, uint32_t page, uint32_t count, uint8_t *buf,
+	int (*each)(void *ctx, uint32_t page, uint8_t *data, int last), void *ctx)
+{
+	uint32_t done = 0;
+	int tries = 0;
+	int stop = 0;
+	int res;
+
+	while (done < count) {
+		res = OLS_FlashWriteVerifyPages(ols, page + done, count - done, buf + done * ols->flash->page_size,
+			each, ctx, &stop);
+		if (res < 0)
+			return res;
+
+		if (res > 0)
+			tries = 0;
+		done += res;
+
+		if (stop)
+			break;
+
+		if ((done < count) && OLS_Retry(ols, page + done, &tries))
+			break;
+	}
+
+	return done;
+}
@@ -22,32 +22,111 @@
 
 #include <stdint.h>
 
+// largest page we ever frame (AT45 264 byte pages)
+#define OLS_PAGE_SIZE_MAX 264
+
+// number of page commands kept in flight by default
+#define OLS_WINDOW_DEFAULT 8
+#define OLS_WINDOW_MAX 64
+
+// times a page which reads back different is written again
+#define OLS_REWRITE_MAX 2
+
+// times a page which failed in transfer is tried again, after resync
+#define OLS_RETRIES_DEFAULT 3
+
 struct ols_flash_t {
-	const char *jedec_id;
+	uint32_t jedec;		// JEDEC id, first byte in MSB
 	uint16_t page_size;
-	uint16_t pages;
-	const char *name;
+	uint32_t pages;
+	uint8_t addr_shift;	// flash address of page is page << addr_shift
+	uint32_t program_us;	// typical page program time
+	uint32_t erase_ms;	// typical chip erase time
+	char name[32];
+};
+
+// reply latency samples kept for timeout estimation, learned timeouts are
+// used once there are at least OLS_LAT_MIN of them
+#define OLS_LAT_SAMPLES 64
+#define OLS_LAT_MIN 8
+
+struct ols_lat_t {
+	uint32_t us[OLS_LAT_SAMPLES];
+	uint32_t count;		// samples taken in total
+	uint32_t p50_us;
+	uint32_t p99_us;
+};
+
+/* measured behaviour of device with its flash part */
+struct ols_profile_t {
+	uint8_t id[4];		// HW, FW major, FW minor, boot version
+	uint32_t jedec;
+	struct ols_lat_t read;	// reply of page read, per page
+	struct ols_lat_t write;	// reply of page write
+	uint32_t erase_ms;	// last chip erase, 0 if not measured
+};
+
+struct ols_t;
+struct ols_usb_t;
+
+/* transport used to talk to OLS */
+struct ols_io_t {
+	char *name;
+
+	int (*Open)(struct ols_t *, const char *, unsigned long);
+	int (*Close)(struct ols_t *);
+	int (*Read)(struct ols_t *, uint8_t *, int, int);
+	int (*Write)(struct ols_t *, uint8_t *, int);
 };
 
 struct ols_t {
 	int fd;
-	struct ols_flash_t *flash;
+	struct ols_usb_t *usb;
+	const struct ols_io_t *io;
+	const struct ols_flash_t *flash;
 	int verbose;
+	int window;
+	int retries;
+
+	// number of page retries and successful resyncs
+	uint32_t retried;
+	uint32_t resynced;
+
+	// command cut short by failed write, device waits for its rest
+	uint8_t cut[4 + OLS_PAGE_SIZE_MAX + 1];
+	uint16_t cut_size;	// 0 if nothing was cut
+	uint16_t cut_sent;
+
+	// timeouts are sized from this once there are enough samples
+	struct ols_profile_t profile;
+
+	// profile is cached here between sessions, NULL if not cached
+	char *cache;
+
+	// called for every page done, replaces progress dots
+	void (*progress)(struct ols_t *, uint32_t);
 };
 
 
 struct ols_t *OLS_Init(char *, unsigned long); 
+uint32_t OLS_MaxFlashSize(void);
 int OLS_Deinit(struct ols_t *);
+void OLS_ProfilePrint(struct ols_t *);
 int OLS_RunSelftest(struct ols_t *);
 int OLS_GetStatus(struct ols_t *);
 int OLS_GetID(struct ols_t *);
 int OLS_EnterBootloader(struct ols_t *);
 int OLS_EnterRunMode(struct ols_t *);
 int OLS_GetFlashID(struct ols_t *);
-struct ols_flash_t *OLS_GetFlash(struct ols_t *);
 int OLS_FlashErase(struct ols_t *);
-int OLS_FlashRead(struct ols_t *, uint16_t page, uint8_t *buf);
-int OLS_FlashWrite(struct ols_t *, uint16_t page, uint8_t *buf);
+int OLS_FlashRead(struct ols_t *, uint32_t page, uint8_t *buf);
+int OLS_FlashReadMulti(struct ols_t *, uint32_t page, uint32_t count, uint8_t *buf);
+int OLS_FlashReadRing(struct ols_t *, uint32_t page, uint32_t count, uint8_t *ring, uint32_t ring_pages,
+	int (*each)(void *ctx, uint32_t page, uint8_t *data), void *ctx);
+int OLS_FlashWrite(struct ols_t *, uint32_t page, uint8_t *buf);
+int OLS_FlashWriteMulti(struct ols_t *, uint32_t page, uint32_t count, uint8_t *buf);
+int OLS_FlashWriteVerify(struct ols_t *, uint32_t page, uint32_t count, uint8_t *buf,
+	int (*each)(void *ctx, uint32_t page, uint8_t *data, int last), void *ctx);
 
 #endif
 
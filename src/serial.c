@@ -25,6 +25,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 #include <string.h>
 
@@ -97,8 +99,9 @@ int serial_setup(int fd, unsigned long speed)
 	t_opt.c_iflag &= ~(ICRNL | INLCR);
 	t_opt.c_oflag &= ~(OCRNL | ONLCR);
 	t_opt.c_oflag &= ~OPOST;
+	// non blocking reads, waiting is done by serial_wait
 	t_opt.c_cc[VMIN] = 0;
-	t_opt.c_cc[VTIME] = 1;
+	t_opt.c_cc[VTIME] = 0;
 
 #if IS_DARWIN
 	if( tcsetattr(fd, TCSANOW, &t_opt) < 0 ) {
@@ -141,6 +144,97 @@ int serial_write(int fd, const char *buf, int size)
 	return ret;
 }
 
+/*
+ * returns monotonic time in ms
+ */
+uint64_t serial_time_ms(void)
+{
+#if IS_WIN32
+	return GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*
+ * returns monotonic time in us
+ */
+uint64_t serial_time_us(void)
+{
+#if IS_WIN32
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)now.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * sleeps for ms
+ */
+void serial_sleep_ms(uint32_t ms)
+{
+#if IS_WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+#if !IS_WIN32
+/*
+ * waits until fd is readable or ms elapses
+ * returns 1 readable, 0 timeout, -1 error
+ */
+static int serial_wait(int fd, int ms)
+{
+	int ret;
+#if IS_DARWIN
+	// poll() does not work on tty devices here
+	fd_set rfds;
+	struct timeval tv;
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	ret = select(fd + 1, &rfds, NULL, NULL, &tv);
+#else
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, ms);
+	if ((ret > 0) && !(pfd.revents & POLLIN)) {
+		// POLLERR/POLLHUP without data - device is gone
+		return -1;
+	}
+#endif
+	if (ret < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+
+	return (ret > 0) ? 1 : 0;
+}
+#endif
+
+/*
+ * reads size bytes from serial port
+ * timeout - deadline in ms for the whole transfer
+ * returns number of bytes read, or -1 on error
+ */
 int serial_read(int fd, char *buf, int size, int timeout)
 {
 	int len = 0;
@@ -148,8 +242,16 @@ int serial_read(int fd, char *buf, int size, int timeout)
 
 #if IS_WIN32
 	HANDLE hCom = (HANDLE)fd;
+	COMMTIMEOUTS timeouts;
 	unsigned long bread = 0;
 
+	// whole read has to finish within timeout
+	GetCommTimeouts(hCom, &timeouts);
+	timeouts.ReadIntervalTimeout = 0;
+	timeouts.ReadTotalTimeoutMultiplier = 0;
+	timeouts.ReadTotalTimeoutConstant = timeout;
+	SetCommTimeouts(hCom, &timeouts);
+
 	ret = ReadFile(hCom, buf, size, &bread, NULL);
 
 	if( ret == FALSE || ret==-1 ) {
@@ -159,21 +261,33 @@ int serial_read(int fd, char *buf, int size, int timeout)
 	}
 
 #else
+	uint64_t deadline;
+	uint64_t now;
+
+	deadline = serial_time_ms() + timeout;
+
 	while (len < size) {
+		now = serial_time_ms();
+		if (now >= deadline)
+			break;
+
+		ret = serial_wait(fd, deadline - now);
+		if (ret < 0)
+			return (len > 0) ? len : -1;
+
+		if (ret == 0)
+			continue;
+
 		ret = read(fd, buf+len, size-len);
 		if (ret == -1){
-			//printf("ret -1");
+			if ((errno == EAGAIN) || (errno == EINTR))
+				continue;
 			return -1;
 		}
 
-		if (ret == 0) {
-			timeout--;
-
-			if (timeout <= 0)
-				break;
-
-			continue;
-		}
+		// readable but nothing read, port was hung up
+		if (ret == 0)
+			return (len > 0) ? len : -1;
 
 		len += ret;
 	}
@@ -38,6 +38,7 @@ typedef long speed_t;
 
 #include <unistd.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -56,6 +57,9 @@ typedef long speed_t;
 int serial_setup(int fd, unsigned long speed);
 int serial_write(int fd, const char *buf, int size);
 int serial_read(int fd, char *buf, int size, int timeout);
+uint64_t serial_time_ms(void);
+uint64_t serial_time_us(void);
+void serial_sleep_ms(uint32_t ms);
 int serial_open(const char *port);
 int serial_close(int fd);
 